@@ -0,0 +1,173 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// Batched -fsyntax-only test stages.
+//
+// Starting the compiler is a good part of checking a small file.  A worker
+// that reaches a -fsyntax-only test joins the open batch for its compiler
+// and flags, or opens one.  The worker that opened it runs the compiler
+// once on every file in the batch when the batch is full, when every
+// worker is waiting on a batch so no more files can come, or when it has
+// waited BatchWait.
+//
+// A clean batch passes all of its files.  A batch that fails does not say
+// which file broke it, so each of its workers runs its own file again.
+// Only those runs show their diagnostics, the batch's output is shown
+// when it passes.
+//
+//===----------------------------------------------------------------------===//
+#include "Batch.h"
+#include "Process.h"
+#include "TempFile.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct Batch {
+  vector<string> Flags;
+  vector<string> Inputs;
+  bool Closed = false;
+  bool Done = false;
+  int Result = 0;
+  double T = 0;
+};
+
+// Longest a batch waits for more files before it runs
+static const chrono::milliseconds BatchWait(1000);
+
+static mutex BatchMutex;
+static condition_variable BatchChanged;
+// compiler and flags -> batch taking files
+static map<string, shared_ptr<Batch>> Open;
+static unsigned Size = 1, Active = 0, Waiting = 0;
+static unsigned Runs = 0, Files = 0, Failed = 0;
+
+void BatchInit(unsigned S, unsigned Workers) {
+  lock_guard<mutex> lock(BatchMutex);
+  Size = S;
+  Active = Workers;
+  Waiting = 0;
+  Runs = Files = Failed = 0;
+}
+
+void BatchWorkerDone() {
+  lock_guard<mutex> lock(BatchMutex);
+  if (Active)
+    Active--;
+  BatchChanged.notify_all();
+}
+
+// The test command line without its input and output.  Only syntax
+// checks of a single input can be batched, they write nothing.
+static bool BatchFlags(vector<string> &CL, string &IF, vector<string> &Flags,
+                       string &Key) {
+  if (find(CL.begin(), CL.end(), "-fsyntax-only") == CL.end())
+    return false;
+  if (count(CL.begin(), CL.end(), IF) != 1)
+    return false;
+  for (size_t i = 0; i < CL.size(); i++) {
+    if (CL[i] == IF)
+      continue;
+    if (CL[i] == "-o" && i + 1 < CL.size()) {
+      i++;
+      continue;
+    }
+    Flags.push_back(CL[i]);
+    Key += CL[i];
+    Key += '\0';
+  }
+  return true;
+}
+
+static void BatchClose(string &Key, shared_ptr<Batch> &B) {
+  B->Closed = true;
+  auto o = Open.find(Key);
+  if (o != Open.end() && o->second == B)
+    Open.erase(o);
+}
+
+bool BatchProcess(vector<string> &CL, string &IF, int &Result, double &T) {
+  vector<string> Flags;
+  string Key;
+  if (Size < 2 || !BatchFlags(CL, IF, Flags, Key))
+    return false;
+
+  unique_lock<mutex> lock(BatchMutex);
+  shared_ptr<Batch> B;
+  auto o = Open.find(Key);
+  bool Leader = o == Open.end();
+  if (Leader) {
+    B = make_shared<Batch>();
+    B->Flags = Flags;
+    Open[Key] = B;
+  } else {
+    B = o->second;
+  }
+  B->Inputs.push_back(IF);
+  if (B->Inputs.size() >= Size)
+    BatchClose(Key, B);
+  Waiting++;
+  BatchChanged.notify_all();
+
+  if (Leader) {
+    BatchChanged.wait_for(lock, BatchWait,
+                          [&B] { return B->Closed || Waiting >= Active; });
+    if (!B->Closed)
+      BatchClose(Key, B);
+    // Running, this worker may join another batch when it is done
+    Waiting--;
+    vector<string> A = B->Flags;
+    A.insert(A.end(), B->Inputs.begin(), B->Inputs.end());
+    lock.unlock();
+
+    auto Start = chrono::steady_clock::now();
+    string Out, Err;
+    int R = ProcessCapture(A, Out, Err);
+    chrono::duration<double> D = chrono::steady_clock::now() - Start;
+    if (R == 0 || B->Inputs.size() == 1)
+      ProcessEcho(Out, Err);
+    TempFileRemove(Out);
+    TempFileRemove(Err);
+
+    lock.lock();
+    B->Result = R;
+    B->T = D.count();
+    B->Done = true;
+    Runs++;
+    Files += B->Inputs.size();
+    if (R != 0 && B->Inputs.size() > 1)
+      Failed++;
+    BatchChanged.notify_all();
+  } else {
+    BatchChanged.wait(lock, [&B] { return B->Done; });
+    Waiting--;
+  }
+
+  T += B->T / B->Inputs.size();
+  if (B->Result != 0 && B->Inputs.size() > 1)
+    return false;
+  Result = B->Result;
+  return true;
+}
+
+void BatchCounts(unsigned &R, unsigned &F, unsigned &X) {
+  lock_guard<mutex> lock(BatchMutex);
+  R = Runs;
+  F = Files;
+  X = Failed;
+}
@@ -0,0 +1,28 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+
+// Batches of up to Size files for Workers threads
+void BatchInit(unsigned Size, unsigned Workers);
+// A worker is done and will not join any more batches
+void BatchWorkerDone();
+// Check IF with CL together with other files that have the same flags.
+// Returns false when the batch failed and CL has to be run on its own.
+// T gets this file's share of the batch.
+bool BatchProcess(std::vector<std::string> &CL, std::string &IF, int &Result,
+                  double &T);
+void BatchCounts(unsigned &Runs, unsigned &Files, unsigned &Failed);
+
+#endif
@@ -0,0 +1,37 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#include "Builtin.h"
+#include <stdio.h>
+#include <string.h>
+using namespace std;
+
+struct BuiltinTool {
+  const char *Name;
+  int (*Main)(vector<string> &A, FILE *Out, FILE *Err);
+};
+
+static BuiltinTool Builtins[] = {
+    {"s2s:clang-tidy", BuiltinClangTidy},
+    {"s2s:diff", BuiltinDiff},
+};
+
+bool IsBuiltin(vector<string> &A) {
+  return A.size() && A[0].compare(0, 4, "s2s:") == 0;
+}
+
+int BuiltinRun(vector<string> &A, FILE *Out, FILE *Err) {
+  for (auto &b : Builtins)
+    if (A[0] == b.Name)
+      return b.Main(A, Out, Err);
+  fprintf(Err, "Unknown builtin tool %s\n", A[0].c_str());
+  fflush(Err);
+  return -1;
+}
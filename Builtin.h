@@ -0,0 +1,30 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#ifndef BUILTIN_H
+#define BUILTIN_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Tools that run inside the driver.  A command line from the script
+// whose first argument is s2s:<tool> runs the builtin instead of
+// starting a process.  The result is the tool's exit code.  A builtin
+// writes to Out and Err, it never reads stdin.
+bool IsBuiltin(std::vector<std::string> &A);
+int BuiltinRun(std::vector<std::string> &A, FILE *Out, FILE *Err);
+
+int BuiltinClangTidy(std::vector<std::string> &A, FILE *Out, FILE *Err);
+int BuiltinDiff(std::vector<std::string> &A, FILE *Out, FILE *Err);
+
+bool FilesIdentical(std::string &A, std::string &B);
+
+#endif
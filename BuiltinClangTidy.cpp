@@ -0,0 +1,291 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// s2s:clang-tidy, clang-tidy checks run inside the driver
+//
+// s2s:clang-tidy [-checks=<c>] [-header-filter=<r>] [-export-fixes=<f>]
+//                [-fix] <source> ... -- <compiler flags>
+//
+// The compile flags come from the command line, so no compile database
+// has to be written for the file.  With -fix the replacements are applied
+// to the sources, never to the headers they include.
+//
+// The diagnostics are printed here, without the source lines, to the
+// job's output.  clang-tidy would print them to llvm::outs(), which all
+// of the jobs share.
+//
+//===----------------------------------------------------------------------===//
+#include "Builtin.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#ifdef S2S_CLANG_TIDY
+#include "ClangTidy.h"
+#include "ClangTidyDiagnosticConsumer.h"
+#include "ClangTidyForceLinker.h"
+#include "ClangTidyOptions.h"
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Basic/FileManager.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Core/Replacement.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <map>
+
+using namespace clang;
+using namespace clang::tidy;
+using namespace clang::tooling;
+using namespace std;
+
+namespace {
+// The action factory of clang-tidy's runClangTidy, which cannot be
+// handed a file manager of its own.
+class TidyActionFactory : public FrontendActionFactory {
+public:
+  TidyActionFactory(ClangTidyContext &Context,
+                    IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> FS)
+      : ConsumerFactory(Context, FS) {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<Action>(&ConsumerFactory);
+  }
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    // The analyzer checks expect __clang_analyzer__
+    Invocation->getPreprocessorOpts().SetUpStaticAnalyzer = true;
+    return FrontendActionFactory::runInvocation(Invocation, Files,
+                                                PCHContainerOps, DiagConsumer);
+  }
+
+private:
+  class Action : public ASTFrontendAction {
+  public:
+    Action(ClangTidyASTConsumerFactory *Factory) : Factory(Factory) {}
+    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &Compiler,
+                                                   StringRef File) override {
+      return Factory->createASTConsumer(Compiler, File);
+    }
+
+  private:
+    ClangTidyASTConsumerFactory *Factory;
+  };
+
+  ClangTidyASTConsumerFactory ConsumerFactory;
+};
+} // namespace
+
+// The file system and the pch readers are made once per worker thread.
+// Each translation unit gets a file manager of its own, one kept across
+// them would cache the stat and contents of a file that has since been
+// edited, and grow with every file of the database.
+static thread_local IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> OverlayFS;
+static thread_local std::shared_ptr<PCHContainerOperations> PCHOperations;
+
+// The files the diagnostics are in, read once per run
+typedef map<string, std::unique_ptr<llvm::MemoryBuffer>> BufferMap;
+
+// file:line:col: of a diagnostic
+static void PrintLocation(FILE *Out, const tooling::DiagnosticMessage &M,
+                          const string &BuildDirectory, BufferMap &Buffers) {
+  if (M.FilePath.empty())
+    return;
+  llvm::SmallString<256> Path(M.FilePath);
+  if (llvm::sys::path::is_relative(Path))
+    llvm::sys::fs::make_absolute(BuildDirectory, Path);
+  auto &B = Buffers[Path.str().str()];
+  if (!B) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (Buffer)
+      B = std::move(*Buffer);
+  }
+  unsigned Line = 1, Column = 1;
+  if (B) {
+    llvm::StringRef Text = B->getBuffer().substr(0, M.FileOffset);
+    Line += Text.count('\n');
+    size_t NL = Text.rfind('\n');
+    Column += NL == llvm::StringRef::npos ? Text.size() : Text.size() - NL - 1;
+  }
+  fprintf(Out, "%s:%u:%u: ", Path.c_str(), Line, Column);
+}
+
+// Returns the number of warnings made errors
+static unsigned PrintErrors(FILE *Out, std::vector<ClangTidyError> &Errors) {
+  unsigned WarningsAsErrors = 0;
+  BufferMap Buffers;
+  for (auto &E : Errors) {
+    if (E.IsWarningAsError)
+      WarningsAsErrors++;
+    PrintLocation(Out, E.Message, E.BuildDirectory, Buffers);
+    fprintf(Out, "%s: %s [%s]\n",
+            E.DiagLevel == ClangTidyError::Error ? "error" : "warning",
+            E.Message.Message.c_str(), E.DiagnosticName.c_str());
+    for (auto &N : E.Notes) {
+      PrintLocation(Out, N, E.BuildDirectory, Buffers);
+      fprintf(Out, "note: %s\n", N.Message.c_str());
+    }
+  }
+  fflush(Out);
+  return WarningsAsErrors;
+}
+
+static bool ApplyFixes(std::vector<ClangTidyError> &Errors,
+                       vector<string> &Sources, FILE *Err) {
+  bool ret = true;
+  map<string, Replacements> FileReplacements;
+  for (auto &Error : Errors) {
+    const llvm::StringMap<Replacements> *Fixes = getFixIt(Error, false);
+    if (Fixes == nullptr)
+      continue;
+    for (auto &F : *Fixes) {
+      for (const Replacement &R : F.getValue()) {
+        string Path = R.getFilePath().str();
+        if (find(Sources.begin(), Sources.end(), Path) == Sources.end())
+          continue;
+        // Overlapping fixes are dropped, as clang-tidy does
+        if (llvm::Error Err = FileReplacements[Path].add(R))
+          llvm::consumeError(std::move(Err));
+      }
+    }
+  }
+
+  for (auto &F : FileReplacements) {
+    auto Buffer = llvm::MemoryBuffer::getFile(F.first);
+    if (!Buffer) {
+      ret = false;
+      continue;
+    }
+    llvm::Expected<string> Code =
+        applyAllReplacements((*Buffer)->getBuffer(), F.second);
+    if (!Code) {
+      fprintf(Err, "%s\n", llvm::toString(Code.takeError()).c_str());
+      ret = false;
+      continue;
+    }
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(F.first, EC, llvm::sys::fs::OF_None);
+    if (EC) {
+      fprintf(Err, "%s : %s\n", F.first.c_str(), EC.message().c_str());
+      ret = false;
+      continue;
+    }
+    OS << *Code;
+  }
+  return ret;
+}
+
+int BuiltinClangTidy(vector<string> &A, FILE *Out, FILE *Err) {
+  string Checks, HeaderFilter, ExportFixes;
+  bool Fix = false;
+  vector<string> Sources, Flags;
+
+  size_t i = 1;
+  for (; i < A.size(); i++) {
+    string &a = A[i];
+    if (a == "--") {
+      i++;
+      break;
+    }
+    if (a.compare(0, 8, "-checks=") == 0)
+      Checks = a.substr(8);
+    else if (a.compare(0, 15, "-header-filter=") == 0)
+      HeaderFilter = a.substr(15);
+    else if (a.compare(0, 14, "-export-fixes=") == 0)
+      ExportFixes = a.substr(14);
+    else if (a == "-fix")
+      Fix = true;
+    else if (a.size() && a[0] == '-')
+      fprintf(Err, "%s : ignoring %s\n", A[0].c_str(), a.c_str());
+    else
+      Sources.push_back(a);
+  }
+  for (; i < A.size(); i++)
+    Flags.push_back(A[i]);
+
+  if (Sources.empty()) {
+    fprintf(Err, "%s : no input files\n", A[0].c_str());
+    fflush(Err);
+    return 1;
+  }
+
+  if (!OverlayFS) {
+    OverlayFS = new llvm::vfs::OverlayFileSystem(llvm::vfs::getRealFileSystem());
+    PCHOperations = std::make_shared<PCHContainerOperations>();
+  }
+  IntrusiveRefCntPtr<FileManager> Files(
+      new FileManager(FileSystemOptions(), OverlayFS));
+
+  ClangTidyOptions Options = ClangTidyOptions::getDefaults();
+  if (Checks.size())
+    Options.Checks = Checks;
+  if (HeaderFilter.size())
+    Options.HeaderFilterRegex = HeaderFilter;
+  ClangTidyContext Context(std::make_unique<DefaultOptionsProvider>(
+      ClangTidyGlobalOptions(), Options));
+
+  llvm::SmallString<256> Directory;
+  llvm::sys::fs::current_path(Directory);
+  FixedCompilationDatabase Compilations(Directory, Flags);
+  ClangTool Tool(Compilations, Sources, PCHOperations, OverlayFS, Files);
+  Tool.appendArgumentsAdjuster(getStripPluginsAdjuster());
+
+  ClangTidyDiagnosticConsumer DiagConsumer(Context);
+  DiagnosticsEngine DE(new DiagnosticIDs(), new DiagnosticOptions(),
+                       &DiagConsumer, /*ShouldOwnClient=*/false);
+  Context.setDiagnosticsEngine(&DE);
+  Tool.setDiagnosticConsumer(&DiagConsumer);
+
+  TidyActionFactory Factory(Context, OverlayFS);
+  int ret = Tool.run(&Factory);
+  std::vector<ClangTidyError> Errors = DiagConsumer.take();
+
+  if (PrintErrors(Out, Errors))
+    ret = 1;
+
+  if (ExportFixes.size()) {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(ExportFixes, EC, llvm::sys::fs::OF_None);
+    if (EC) {
+      fprintf(Err, "%s : %s\n", ExportFixes.c_str(), EC.message().c_str());
+      ret = 1;
+    } else {
+      exportReplacements(Sources[0], Errors, OS);
+    }
+  }
+
+  if (Fix && !ApplyFixes(Errors, Sources, Err))
+    ret = 1;
+
+  fflush(Err);
+  return ret;
+}
+#else
+int BuiltinClangTidy(std::vector<std::string> &A, FILE *Out, FILE *Err) {
+  fprintf(Err, "%s is not available, configure s2s with "
+               "-DS2S_CLANG_TIDY=ON\n",
+          A[0].c_str());
+  fflush(Err);
+  return -1;
+}
+#endif
@@ -0,0 +1,353 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// s2s:diff, diff -u run inside the driver
+//
+// s2s:diff [-u] [-p] <a> <b>
+//
+// The exit code is diff's, 0 when the files are the same, 1 when they
+// differ and 2 when one can not be read.  The unified diff, with the
+// enclosing function in the hunk headers for -p, goes to stdout.
+//
+// Files of the same size are compared with memcmp first.  Otherwise the
+// lines are split with memchr, interned to integers and compared with
+// Myers' O(ND) algorithm, in its linear space form, after the common
+// head and tail are trimmed.
+//
+//===----------------------------------------------------------------------===//
+#include "Builtin.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace std;
+using llvm::StringRef;
+
+static const long Context = 3;
+
+static bool ReadFile(string &F, unique_ptr<llvm::MemoryBuffer> &B) {
+  auto Buffer = llvm::MemoryBuffer::getFile(F, false, false);
+  if (!Buffer)
+    return false;
+  B = std::move(*Buffer);
+  return true;
+}
+
+bool FilesIdentical(string &A, string &B) {
+  struct stat sa, sb;
+  if (stat(A.c_str(), &sa) || stat(B.c_str(), &sb))
+    return false;
+  if (sa.st_size != sb.st_size)
+    return false;
+  unique_ptr<llvm::MemoryBuffer> BA, BB;
+  if (!ReadFile(A, BA) || !ReadFile(B, BB))
+    return false;
+  return BA->getBufferSize() == BB->getBufferSize() &&
+         memcmp(BA->getBufferStart(), BB->getBufferStart(),
+                BA->getBufferSize()) == 0;
+}
+
+// Lines keep their '\n', so a last line without one differs from the
+// same line with one, as it does for diff
+static void SplitLines(StringRef S, vector<StringRef> &L) {
+  const char *p = S.begin(), *e = S.end();
+  while (p < e) {
+    const char *n = (const char *)memchr(p, '\n', e - p);
+    const char *l = n ? n + 1 : e;
+    L.push_back(StringRef(p, l - p));
+    p = l;
+  }
+}
+
+static void Intern(vector<StringRef> &L, llvm::StringMap<int> &Ids,
+                   vector<int> &Out) {
+  Out.reserve(L.size());
+  for (auto &l : L)
+    Out.push_back(Ids.insert(make_pair(l, (int)Ids.size())).first->second);
+}
+
+// The middle snake of the shortest edit script of a[0,n) and b[0,m),
+// found by searching forward from the start and backward from the end
+// at once until the two meet.  The snake runs from (x,y) to (u,v).
+static void MiddleSnake(const int *a, long n, const int *b, long m,
+                        vector<long> &Vf, vector<long> &Vb, long &x, long &y,
+                        long &u, long &v) {
+  long Off = Vf.size() / 2;
+  long Delta = n - m;
+  bool Odd = Delta & 1;
+  Vf[Off + 1] = 0;
+  Vb[Off + 1] = 0;
+  for (long d = 0; d <= (n + m + 1) / 2; d++) {
+    // Forward, Vf[k] is the furthest x on diagonal k = x - y
+    for (long k = -d; k <= d; k += 2) {
+      long fx;
+      if (k == -d || (k != d && Vf[Off + k - 1] < Vf[Off + k + 1]))
+        fx = Vf[Off + k + 1];
+      else
+        fx = Vf[Off + k - 1] + 1;
+      long fy = fx - k, sx = fx, sy = fy;
+      while (fx < n && fy < m && a[fx] == b[fy]) {
+        fx++;
+        fy++;
+      }
+      Vf[Off + k] = fx;
+      long c = Delta - k;
+      if (Odd && c >= -(d - 1) && c <= d - 1 && fx + Vb[Off + c] >= n) {
+        x = sx;
+        y = sy;
+        u = fx;
+        v = fy;
+        return;
+      }
+    }
+    // Backward, Vb[c] is the furthest from the end on diagonal c, which
+    // is diagonal Delta - c going forward
+    for (long c = -d; c <= d; c += 2) {
+      long bx;
+      if (c == -d || (c != d && Vb[Off + c - 1] < Vb[Off + c + 1]))
+        bx = Vb[Off + c + 1];
+      else
+        bx = Vb[Off + c - 1] + 1;
+      long by = bx - c, sx = bx, sy = by;
+      while (bx < n && by < m && a[n - 1 - bx] == b[m - 1 - by]) {
+        bx++;
+        by++;
+      }
+      Vb[Off + c] = bx;
+      long k = Delta - c;
+      if (!Odd && k >= -d && k <= d && bx + Vf[Off + k] >= n) {
+        x = n - bx;
+        y = m - by;
+        u = n - sx;
+        v = m - sy;
+        return;
+      }
+    }
+  }
+  // Not reached, the searches meet by (n + m + 1) / 2
+  x = u = n;
+  y = v = m;
+}
+
+// Myers' linear space algorithm on a[0,n) and b[0,m), marking the lines
+// of a that are deleted and of b that are inserted.  Only the two
+// diagonal vectors are kept, so a large file with many changes needs
+// memory in proportion to its length, not to the length times the
+// number of changes.
+static void Compare(const int *a, long n, const int *b, long m,
+                    vector<bool> &DelA, vector<bool> &InsB, long OffA,
+                    long OffB, vector<long> &Vf, vector<long> &Vb) {
+  while (n && m && a[0] == b[0]) {
+    a++;
+    b++;
+    n--;
+    m--;
+    OffA++;
+    OffB++;
+  }
+  while (n && m && a[n - 1] == b[m - 1]) {
+    n--;
+    m--;
+  }
+  if (n == 0 || m == 0) {
+    for (long i = 0; i < n; i++)
+      DelA[OffA + i] = true;
+    for (long j = 0; j < m; j++)
+      InsB[OffB + j] = true;
+    return;
+  }
+  long x, y, u, v;
+  MiddleSnake(a, n, b, m, Vf, Vb, x, y, u, v);
+  Compare(a, x, b, y, DelA, InsB, OffA, OffB, Vf, Vb);
+  Compare(a + u, n - u, b + v, m - v, DelA, InsB, OffA + u, OffB + v, Vf,
+          Vb);
+}
+
+static void Myers(const int *a, long n, const int *b, long m,
+                  vector<bool> &DelA, vector<bool> &InsB, long OffA,
+                  long OffB) {
+  vector<long> Vf(2 * (n + m) + 6, 0), Vb(2 * (n + m) + 6, 0);
+  Compare(a, n, b, m, DelA, InsB, OffA, OffB, Vf, Vb);
+}
+
+static void PrintLine(FILE *Out, char c, StringRef l) {
+  fputc(c, Out);
+  fwrite(l.data(), 1, l.size(), Out);
+  if (l.empty() || l.back() != '\n')
+    fputs("\n\\ No newline at end of file\n", Out);
+}
+
+static void PrintHeader(FILE *Out, const char *Mark, string &F) {
+  struct stat st;
+  char t[64] = "", z[16] = "";
+  long ns = 0;
+  if (stat(F.c_str(), &st) == 0) {
+    struct tm tm;
+    localtime_r(&st.st_mtime, &tm);
+    strftime(t, sizeof(t), "%Y-%m-%d %H:%M:%S", &tm);
+    strftime(z, sizeof(z), "%z", &tm);
+#ifdef __linux__
+    ns = st.st_mtim.tv_nsec;
+#endif
+  }
+  fprintf(Out, "%s %s\t%s.%09ld %s\n", Mark, F.c_str(), t, ns, z);
+}
+
+// The nearest line above the hunk starting like a C definition, what
+// diff -p shows
+static void PrintFunction(FILE *Out, vector<StringRef> &A, long Start,
+                          long &Last, StringRef &Function) {
+  for (long i = Start - 1; i > Last; i--) {
+    StringRef l = A[i];
+    if (l.size() && (isalpha((unsigned char)l[0]) || l[0] == '_' ||
+                     l[0] == '$')) {
+      Function = l;
+      break;
+    }
+  }
+  Last = Start - 1;
+  StringRef f = Function.substr(0, 40).rtrim();
+  if (f.size())
+    fprintf(Out, " %.*s", (int)f.size(), f.data());
+}
+
+static void PrintRange(FILE *Out, long Start, long Count) {
+  if (Count == 0)
+    fprintf(Out, "%ld,0", Start);
+  else if (Count == 1)
+    fprintf(Out, "%ld", Start + 1);
+  else
+    fprintf(Out, "%ld,%ld", Start + 1, Count);
+}
+
+int BuiltinDiff(vector<string> &A, FILE *Out, FILE *Err) {
+  bool Function = false;
+  vector<string> Files;
+  for (size_t i = 1; i < A.size(); i++) {
+    string &a = A[i];
+    if (a.size() > 1 && a[0] == '-') {
+      for (size_t j = 1; j < a.size(); j++)
+        if (a[j] == 'p')
+          Function = true;
+        else if (a[j] != 'u')
+          fprintf(Err, "%s : ignoring -%c\n", A[0].c_str(), a[j]);
+    } else {
+      Files.push_back(a);
+    }
+  }
+  if (Files.size() != 2) {
+    fprintf(Err, "%s : expected two files\n", A[0].c_str());
+    fflush(Err);
+    return 2;
+  }
+
+  unique_ptr<llvm::MemoryBuffer> BA, BB;
+  if (!ReadFile(Files[0], BA) || !ReadFile(Files[1], BB)) {
+    fprintf(Err, "%s : can not read %s or %s\n", A[0].c_str(),
+            Files[0].c_str(), Files[1].c_str());
+    fflush(Err);
+    return 2;
+  }
+  StringRef SA = BA->getBuffer(), SB = BB->getBuffer();
+  if (SA == SB)
+    return 0;
+
+  vector<StringRef> LA, LB;
+  SplitLines(SA, LA);
+  SplitLines(SB, LB);
+  llvm::StringMap<int> Ids;
+  vector<int> IA, IB;
+  Intern(LA, Ids, IA);
+  Intern(LB, Ids, IB);
+
+  long n = IA.size(), m = IB.size();
+  long Head = 0;
+  while (Head < n && Head < m && IA[Head] == IB[Head])
+    Head++;
+  long Tail = 0;
+  while (Tail < n - Head && Tail < m - Head &&
+         IA[n - 1 - Tail] == IB[m - 1 - Tail])
+    Tail++;
+
+  vector<bool> DelA(n, false), InsB(m, false);
+  Myers(IA.data() + Head, n - Head - Tail, IB.data() + Head, m - Head - Tail,
+        DelA, InsB, Head, Head);
+
+  PrintHeader(Out, "---", Files[0]);
+  PrintHeader(Out, "+++", Files[1]);
+
+  // Walk both files together, grouping changes less than two contexts
+  // apart into one hunk
+  long i = 0, j = 0, Last = -1;
+  StringRef FunctionLine;
+  while (i < n || j < m) {
+    if (i < n && j < m && !DelA[i] && !InsB[j]) {
+      i++;
+      j++;
+      continue;
+    }
+    long si = max(0L, i - Context), sj = max(0L, j - Context);
+    // Find the end of the hunk
+    long ei = i, ej = j, Equal = 0;
+    while (ei < n || ej < m) {
+      if (ei < n && DelA[ei]) {
+        ei++;
+        Equal = 0;
+      } else if (ej < m && InsB[ej]) {
+        ej++;
+        Equal = 0;
+      } else if (Equal < 2 * Context && ei < n && ej < m) {
+        ei++;
+        ej++;
+        Equal++;
+      } else {
+        break;
+      }
+    }
+    // Trailing context is Context lines at most
+    long Trim = max(0L, Equal - Context);
+    ei -= Trim;
+    ej -= Trim;
+
+    fputs("@@ -", Out);
+    PrintRange(Out, si, ei - si);
+    fputs(" +", Out);
+    PrintRange(Out, sj, ej - sj);
+    fputs(" @@", Out);
+    if (Function)
+      PrintFunction(Out, LA, si, Last, FunctionLine);
+    fputc('\n', Out);
+
+    long a = si, b = sj;
+    while (a < ei || b < ej) {
+      if (a < ei && DelA[a]) {
+        PrintLine(Out, '-', LA[a++]);
+      } else if (b < ej && InsB[b]) {
+        PrintLine(Out, '+', LB[b++]);
+      } else {
+        PrintLine(Out, ' ', LA[a++]);
+        b++;
+      }
+    }
+    i = ei;
+    j = ej;
+  }
+  fflush(Out);
+  return 1;
+}
@@ -0,0 +1,306 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// Persistent cache of per file results.
+//
+// An entry is found by the md5 of the script contents, the file name,
+// the compiler, the scrubbed command line and the file contents.  The
+// entry is a manifest
+//   s2s-cache 1
+//   outcome <n>
+//   edited <0|1>
+//   dep <md5> <path>
+// listing every header the file included, with the md5 the header had
+// when the entry was stored.  The entry is only used when all of them
+// are unchanged.  When the run overwrote the file, the new contents are
+// kept beside the manifest in <key>.edit and written back on a hit.
+//
+//===----------------------------------------------------------------------===//
+#include "Cache.h"
+#include "Process.h"
+#include "TempFile.h"
+#include "WriteBack.h"
+#include <ctype.h>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace std;
+using boost::filesystem::path;
+
+static path CacheDir;
+static string ScriptHash;
+
+struct Hashed {
+  time_t mtime;
+  long mtime_nsec;
+  off_t size;
+  string md5;
+};
+
+// Headers are shared by most files, hash each one once per run unless
+// it changes underneath us.
+static map<string, Hashed> Hashes;
+static mutex HashesMutex;
+
+static string HashString(string &S) {
+  llvm::MD5 H;
+  llvm::MD5::MD5Result R;
+  llvm::SmallString<32> Hex;
+  H.update(S);
+  H.final(R);
+  llvm::MD5::stringifyResult(R, Hex);
+  return Hex.str().str();
+}
+
+static bool HashFile(string &F, string &MD5) {
+  struct stat st;
+  if (stat(F.c_str(), &st))
+    return false;
+#ifndef WIN32
+  long nsec = st.st_mtim.tv_nsec;
+#else
+  long nsec = 0;
+#endif
+  {
+    lock_guard<mutex> lock(HashesMutex);
+    auto i = Hashes.find(F);
+    if (i != Hashes.end() && i->second.mtime == st.st_mtime &&
+        i->second.mtime_nsec == nsec && i->second.size == st.st_size) {
+      MD5 = i->second.md5;
+      return true;
+    }
+  }
+  auto Buffer = llvm::MemoryBuffer::getFile(F);
+  if (!Buffer)
+    return false;
+  llvm::MD5 H;
+  llvm::MD5::MD5Result R;
+  llvm::SmallString<32> Hex;
+  H.update((*Buffer)->getBuffer());
+  H.final(R);
+  llvm::MD5::stringifyResult(R, Hex);
+  MD5 = Hex.str().str();
+  lock_guard<mutex> lock(HashesMutex);
+  Hashes[F] = {st.st_mtime, nsec, st.st_size, MD5};
+  return true;
+}
+
+static path CachePath(string &Key) {
+  return CacheDir / Key.substr(0, 2) / Key;
+}
+
+bool CacheInit(string &Dir, string &Script, string &Plugin) {
+  boost::system::error_code EC;
+  CacheDir = boost::filesystem::absolute(path(Dir));
+  boost::filesystem::create_directories(CacheDir, EC);
+  if (EC)
+    return false;
+  ScriptHash.clear();
+  if (Script.size() && !HashFile(Script, ScriptHash))
+    return false;
+  // The plugin's hooks decide as much as the script's
+  string PluginHash;
+  if (Plugin.size()) {
+    if (!HashFile(Plugin, PluginHash))
+      return false;
+    ScriptHash += PluginHash;
+  }
+  return true;
+}
+
+bool CacheKey(string &Key, string &File, string &Exe, vector<string> &CL) {
+  string FileHash;
+  if (!HashFile(File, FileHash))
+    return false;
+  string S = "s2s-cache 1";
+  S += '\0' + ScriptHash + '\0' + File + '\0' + Exe;
+  for (auto &c : CL)
+    S += '\0' + c;
+  S += '\0' + FileHash;
+  Key = HashString(S);
+  return true;
+}
+
+bool CacheLookup(string &Key, string &File, int &Outcome) {
+  path p = CachePath(Key);
+  ifstream in(p.string());
+  if (!in)
+    return false;
+
+  string line, word;
+  int outcome = -1, edited = -1;
+  getline(in, line);
+  if (line != "s2s-cache 1")
+    return false;
+  while (getline(in, line)) {
+    istringstream s(line);
+    s >> word;
+    if (word == "outcome") {
+      s >> outcome;
+    } else if (word == "edited") {
+      s >> edited;
+    } else if (word == "dep") {
+      string md5, dep, current;
+      s >> md5;
+      s.get();
+      getline(s, dep);
+      if (!HashFile(dep, current) || current != md5)
+        return false;
+    } else {
+      return false;
+    }
+  }
+  if (outcome < 0 || edited < 0)
+    return false;
+
+  if (edited) {
+    string Edit = p.string() + ".edit";
+    string Staged;
+    if (!WriteBackStage(File, Edit, Staged) || !WriteBackCommit(Staged))
+      return false;
+  }
+  Outcome = outcome;
+  return true;
+}
+
+// Parse a make rule, target: dep dep \ newline dep
+static void CacheParseRule(string &Rule, vector<string> &Deps) {
+  size_t i = Rule.find(": ");
+  if (i == string::npos)
+    return;
+  string dep;
+  for (i += 2; i < Rule.size(); i++) {
+    char c = Rule[i];
+    if (c == '\\' && i + 1 < Rule.size()) {
+      char n = Rule[i + 1];
+      if (n == '\n' || n == '\r') {
+        i++;
+        continue;
+      }
+      if (n == ' ' || n == '#' || n == '\\') {
+        dep += n;
+        i++;
+        continue;
+      }
+    }
+    if (c == '$' && i + 1 < Rule.size() && Rule[i + 1] == '$') {
+      dep += c;
+      i++;
+      continue;
+    }
+    if (isspace((unsigned char)c)) {
+      if (dep.size())
+        Deps.push_back(dep);
+      dep.clear();
+      continue;
+    }
+    dep += c;
+  }
+  if (dep.size())
+    Deps.push_back(dep);
+}
+
+// The headers the file includes, from the compiler's -M
+bool CacheDependencies(vector<string> &Deps, string &File, string &Exe,
+                       vector<string> &CL) {
+  bool ret = false;
+  string DF, dummy, Out, Err;
+  TempFileName(".d", DF);
+  vector<string> A;
+  A.push_back(Exe);
+  for (auto &c : CL)
+    A.push_back(c);
+  A.push_back("-M");
+  A.push_back("-MF");
+  A.push_back(DF);
+  A.push_back(File);
+  if (Process(A, dummy, Out, Err) == 0) {
+    ifstream in(DF);
+    stringstream s;
+    s << in.rdbuf();
+    string Rule = s.str();
+    vector<string> D;
+    CacheParseRule(Rule, D);
+    for (auto &d : D) {
+      path p = d;
+      if (p.is_relative())
+        p = boost::filesystem::absolute(p);
+      string dep = p.string();
+      if (dep != File)
+        Deps.push_back(dep);
+    }
+    ret = D.size() > 0;
+  }
+  TempFileRemove(Out);
+  TempFileRemove(Err);
+  TempFileRemove(DF);
+  return ret;
+}
+
+bool CacheStore(string &Key, vector<string> &Deps, int Outcome,
+                string &Edit) {
+  path p = CachePath(Key);
+  boost::system::error_code EC;
+  boost::filesystem::create_directories(p.parent_path(), EC);
+  if (EC)
+    return false;
+
+  stringstream s;
+  s << "s2s-cache 1\n";
+  s << "outcome " << Outcome << "\n";
+  s << "edited " << (Edit.size() ? 1 : 0) << "\n";
+  for (auto &d : Deps) {
+    string md5;
+    if (!HashFile(d, md5))
+      return false;
+    s << "dep " << md5 << " " << d << "\n";
+  }
+
+  // Written under a unique name and renamed, so concurrent runs sharing
+  // the cache never see half an entry.  The edit goes first, a manifest
+  // is never there without it.
+  string Tmp = p.string() + "." + boost::filesystem::unique_path().string();
+  if (Edit.size()) {
+    if (!TempFileCopyContents(Tmp, Edit)) {
+      boost::filesystem::remove(path(Tmp), EC);
+      return false;
+    }
+    boost::filesystem::rename(path(Tmp), path(p.string() + ".edit"), EC);
+    if (EC) {
+      boost::filesystem::remove(path(Tmp), EC);
+      return false;
+    }
+  }
+  ofstream out(Tmp, ios::binary | ios::trunc);
+  out << s.str();
+  out.close();
+  if (!out) {
+    boost::filesystem::remove(path(Tmp), EC);
+    return false;
+  }
+  boost::filesystem::rename(path(Tmp), p, EC);
+  if (EC) {
+    boost::filesystem::remove(path(Tmp), EC);
+    return false;
+  }
+  return true;
+}
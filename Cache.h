@@ -0,0 +1,26 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <string>
+#include <vector>
+
+bool CacheInit(std::string &Dir, std::string &Script, std::string &Plugin);
+bool CacheKey(std::string &Key, std::string &File, std::string &Exe,
+              std::vector<std::string> &CL);
+bool CacheLookup(std::string &Key, std::string &File, int &Outcome);
+bool CacheDependencies(std::vector<std::string> &Deps, std::string &File,
+                       std::string &Exe, std::vector<std::string> &CL);
+bool CacheStore(std::string &Key, std::vector<std::string> &Deps, int Outcome,
+                std::string &Edit);
+
+#endif
@@ -0,0 +1,100 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// The database, held for the run and by -server between runs.
+//
+// The entries of a large project repeat the same few hundred arguments
+// tens of thousands of times.  Arguments are interned in an arena and the
+// argument list of an entry has its file and output cut out, so the files
+// of a target share one list.  An entry is made back into a CompileCommand
+// only when it is filtered or run.
+//
+//===----------------------------------------------------------------------===//
+#include "CommandStore.h"
+#include <algorithm>
+#include <functional>
+#include <string>
+
+using namespace std;
+using namespace llvm;
+using namespace clang::tooling;
+
+static const unsigned Uncut = ~0u;
+
+bool CommandStore::ListLess::operator()(const vector<StringRef> &A,
+                                        const vector<StringRef> &B) const {
+  if (A.size() != B.size())
+    return A.size() < B.size();
+  for (size_t i = 0; i < A.size(); i++)
+    if (A[i].data() != B[i].data())
+      return less<const char *>()(A[i].data(), B[i].data());
+  return false;
+}
+
+StringRef CommandStore::intern(StringRef S) {
+  return Strings.insert(S).first->getKey();
+}
+
+void CommandStore::add(const CompileCommand &CC) {
+  StoredCommand S;
+  S.Directory = intern(CC.Directory);
+  S.Filename = intern(CC.Filename);
+  S.Output = intern(CC.Output);
+  S.FileAt = S.OutputAt = Uncut;
+
+  // Only the first of each is cut, as scrub_cl does
+  vector<StringRef> CL;
+  CL.reserve(CC.CommandLine.size());
+  for (size_t i = 0; i < CC.CommandLine.size(); i++) {
+    const string &a = CC.CommandLine[i];
+    if (i && S.FileAt == Uncut && a == CC.Filename) {
+      S.FileAt = i;
+      CL.push_back(StringRef());
+    } else if (i && S.OutputAt == Uncut && CC.CommandLine[i - 1] == "-o") {
+      S.OutputAt = i;
+      S.OutputArg = intern(a);
+      CL.push_back(StringRef());
+    } else {
+      CL.push_back(intern(a));
+    }
+  }
+  S.CommandLine = &*Lists.insert(std::move(CL)).first;
+  Entries.push_back(S);
+}
+
+void CommandStore::clear() {
+  Entries.clear();
+  Lists.clear();
+  // Frees the arena
+  Strings = StringSet<BumpPtrAllocator>();
+}
+
+StringRef StoredCommand::exe() const {
+  if (CommandLine->empty())
+    return StringRef();
+  return (*CommandLine)[0];
+}
+
+void StoredCommand::get(CompileCommand &CC) const {
+  CC.Directory = Directory.str();
+  CC.Filename = Filename.str();
+  CC.Output = Output.str();
+  CC.CommandLine.clear();
+  CC.CommandLine.reserve(CommandLine->size());
+  for (size_t i = 0; i < CommandLine->size(); i++) {
+    if (i == FileAt)
+      CC.CommandLine.push_back(Filename.str());
+    else if (i == OutputAt)
+      CC.CommandLine.push_back(OutputArg.str());
+    else
+      CC.CommandLine.push_back((*CommandLine)[i].str());
+  }
+}
@@ -0,0 +1,63 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#ifndef COMMANDSTORE_H
+#define COMMANDSTORE_H
+
+#include "clang/Tooling/CompilationDatabase.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Allocator.h"
+#include <set>
+#include <vector>
+
+// A database entry in a CommandStore, its strings belong to the store
+struct StoredCommand {
+  llvm::StringRef Directory, Filename, Output;
+  // The argument after the first -o
+  llvm::StringRef OutputArg;
+  // Shared by every entry that differs only in its file and output, the
+  // arguments at FileAt and OutputAt are left empty
+  const std::vector<llvm::StringRef> *CommandLine;
+  unsigned FileAt, OutputAt;
+
+  // The compiler
+  llvm::StringRef exe() const;
+  // The entry as the database had it
+  void get(clang::tooling::CompileCommand &CC) const;
+};
+
+// The loaded database.  Each distinct argument is saved once, and entries
+// built with the same flags share one argument list.
+class CommandStore {
+public:
+  void add(const clang::tooling::CompileCommand &CC);
+  void clear();
+  size_t size() const { return Entries.size(); }
+  std::vector<StoredCommand>::iterator begin() { return Entries.begin(); }
+  std::vector<StoredCommand>::iterator end() { return Entries.end(); }
+  size_t lists() const { return Lists.size(); }
+  size_t strings() const { return Strings.size(); }
+
+private:
+  llvm::StringRef intern(llvm::StringRef S);
+
+  // Interned arguments compare by address
+  struct ListLess {
+    bool operator()(const std::vector<llvm::StringRef> &A,
+                    const std::vector<llvm::StringRef> &B) const;
+  };
+
+  llvm::StringSet<llvm::BumpPtrAllocator> Strings;
+  std::set<std::vector<llvm::StringRef>, ListLess> Lists;
+  std::vector<StoredCommand> Entries;
+};
+
+#endif
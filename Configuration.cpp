@@ -1,9 +1,19 @@
 #include "Scripting.h"
+#include "Configuration.h"
+#include "Plugin.h"
 #include <iostream>
 using namespace std;
 
+// A plugin hook may change the command line the lua hooks were given
+static bool PluginDone(bool ret) {
+  lua_lists_changed();
+  return ret;
+}
+
 bool FilterDBEntry(std::vector<std::string> &ICL, std::string &IF,
                    std::string &ID, std::string &Exe) {
+  if (Plugin.FilterDBEntry)
+    return Plugin.FilterDBEntry(ICL, IF, ID, Exe);
   bool ret = true;
   int O = -1;
   LuaFilterDBEntry(O, ICL, IF, ID, Exe);
@@ -12,27 +22,73 @@ bool FilterDBEntry(std::vector<std::string> &ICL, std::string &IF,
   return ret;
 }
 
+bool FilterDBEntries(vector<FilterArgs> &A, vector<bool> &Keep) {
+  bool ret = false;
+  // The plugin's own hook is called for each entry instead
+  if (Plugin.FilterDBEntry)
+    return false;
+  if (lua_has_hook(HOOK_FILTER_DB_ENTRIES)) {
+    vector<int> O;
+    vector<bool> Ok;
+    lua_batch_begin(HOOK_FILTER_DB_ENTRIES, A.size());
+    for (auto &a : A)
+      lua_batch_add(*a.ICL, *a.IF, *a.ID, *a.Exe);
+    ret = lua_batch_run(O, Ok);
+    if (ret) {
+      Keep.resize(O.size());
+      for (size_t i = 0; i < O.size(); i++)
+        Keep[i] = Ok[i] && O[i] == 1;
+    }
+  }
+  return ret;
+}
+
 bool GetTestConfigurations(vector<string> &TC, string &Exe, string &Ext) {
+  if (Plugin.GetTestConfigurations)
+    return Plugin.GetTestConfigurations(TC, Exe, Ext);
   bool ret = LuaGetTestConfigurations(TC, Exe, Ext);
   return ret;
 }
 bool GetTestStages(vector<string> &TS, string &TC) {
+  if (Plugin.GetTestStages)
+    return Plugin.GetTestStages(TS, TC);
   bool ret = LuaGetTestStages(TS, TC);
   return ret;
 }
 
 bool GetTestCommandLine(vector<string> &OCL, vector<string> &ICL, string &TC,
                         string &TS, string &IF, string &OF, string &Exe) {
+  if (Plugin.GetTestCommandLine)
+    return PluginDone(
+        Plugin.GetTestCommandLine(OCL, ICL, TC, TS, IF, OF, Exe));
   bool ret = LuaGetTestCommandLine(OCL, ICL, TC, TS, IF, OF, Exe);
   return ret;
 }
 
+bool GetTestCommandLines(vector<TestArgs> &A, vector<vector<string>> &OCL,
+                         vector<bool> &Ok) {
+  bool ret = false;
+  if (Plugin.GetTestCommandLine)
+    return false;
+  if (lua_has_hook(HOOK_GET_TEST_COMMAND_LINES)) {
+    lua_batch_begin(HOOK_GET_TEST_COMMAND_LINES, A.size());
+    for (auto &a : A)
+      lua_batch_add(*a.ICL, *a.TC, *a.TS, *a.IF, *a.OF, *a.Exe);
+    ret = lua_batch_run(OCL, Ok);
+  }
+  return ret;
+}
+
 bool GetTestExtension(string &E, string &TS) {
+  if (Plugin.GetTestExtension)
+    return Plugin.GetTestExtension(E, TS);
   bool ret = LuaGetTestExtension(E, TS);
   return ret;
 }
 
 bool IsTestOk(int &I, string &TS) {
+  if (Plugin.IsTestOk)
+    return Plugin.IsTestOk(I, TS);
   bool ret = false;
   int O = -1;
   LuaIsTestOk(O, I, TS);
@@ -43,16 +99,22 @@ bool IsTestOk(int &I, string &TS) {
 
 bool GetS2SCommandLine(vector<string> &OCL, vector<string> &ICL, string &IF,
                        string &OF, string &Exe) {
+  if (Plugin.GetS2SCommandLine)
+    return PluginDone(Plugin.GetS2SCommandLine(OCL, ICL, IF, OF, Exe));
   bool ret = LuaGetS2SCommandLine(OCL, ICL, IF, OF, Exe);
   return ret;
 }
 
 bool GetS2SExtension(string &E) {
+  if (Plugin.GetS2SExtension)
+    return Plugin.GetS2SExtension(E);
   bool ret = LuaGetS2SExtension(E);
   return ret;
 }
 
 bool IsS2SOk(int &I) {
+  if (Plugin.IsS2SOk)
+    return Plugin.IsS2SOk(I);
   bool ret = false;
   int O = -1;
   LuaIsS2SOk(O, I);
@@ -63,16 +125,22 @@ bool IsS2SOk(int &I) {
 
 bool GetEditorCommandLine(vector<string> &OCL, vector<string> &ICL, string &IF,
                           string &OF, string &Exe) {
+  if (Plugin.GetEditorCommandLine)
+    return PluginDone(Plugin.GetEditorCommandLine(OCL, ICL, IF, OF, Exe));
   bool ret = LuaGetEditorCommandLine(OCL, ICL, IF, OF, Exe);
   return ret;
 }
 
 bool GetEditorExtension(string &E) {
+  if (Plugin.GetEditorExtension)
+    return Plugin.GetEditorExtension(E);
   bool ret = LuaGetEditorExtension(E);
   return ret;
 }
 
 bool IsEditorOk(int &I) {
+  if (Plugin.IsEditorOk)
+    return Plugin.IsEditorOk(I);
   bool ret = false;
   int O = -1;
   LuaIsEditorOk(O, I);
@@ -82,6 +150,8 @@ bool IsEditorOk(int &I) {
 }
 
 bool IsOverWriteOk() {
+  if (Plugin.IsOverWriteOk)
+    return Plugin.IsOverWriteOk();
   bool ret = false;
   int O = -1;
   LuaIsOverWriteOk(O);
@@ -91,11 +161,15 @@ bool IsOverWriteOk() {
 }
 
 bool GetDiffCommandLine(vector<string> &OCL, string &AF, string &BF) {
+  if (Plugin.GetDiffCommandLine)
+    return Plugin.GetDiffCommandLine(OCL, AF, BF);
   bool ret = LuaGetDiffCommandLine(OCL, AF, BF);
   return ret;
 }
 
 bool IsDiffOk(int &I) {
+  if (Plugin.IsDiffOk)
+    return Plugin.IsDiffOk(I);
   bool ret = false;
   int O = -1;
   LuaIsDiffOk(O, I);
@@ -3,6 +3,15 @@
 
 extern bool FilterDBEntry(std::vector<std::string> &ICL, std::string &IF,
                           std::string &ID, std::string &Exe);
+// The arguments of one FilterDBEntry
+struct FilterArgs {
+  std::vector<std::string> *ICL;
+  std::string *IF, *ID, *Exe;
+};
+// All of A in one call when the script has FilterDBEntries, Keep gets
+// what FilterDBEntry would have returned for each
+extern bool FilterDBEntries(std::vector<FilterArgs> &A,
+                            std::vector<bool> &Keep);
 extern bool GetTestConfigurations(std::vector<std::string> &TC, std::string &X,
                                   std::string &E);
 extern bool GetTestStages(std::vector<std::string> &TS, std::string &TC);
@@ -10,6 +19,15 @@ extern bool GetTestCommandLine(std::vector<std::string> &OCL,
                                std::vector<std::string> &ICL, std::string &TC,
                                std::string &TS, std::string &IF,
                                std::string &OF, std::string &Exe);
+// The arguments of one GetTestCommandLine
+struct TestArgs {
+  std::vector<std::string> *ICL;
+  std::string *TC, *TS, *IF, *OF, *Exe;
+};
+// All of A in one call when the script has GetTestCommandLines
+extern bool GetTestCommandLines(std::vector<TestArgs> &A,
+                                std::vector<std::vector<std::string>> &OCL,
+                                std::vector<bool> &Ok);
 extern bool GetTestExtension(std::string &E, std::string &TS);
 extern bool IsTestOk(int &I, std::string &TS);
 
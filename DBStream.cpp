@@ -0,0 +1,402 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// Streaming compile_commands.json reader.
+//
+// The database is mapped and decoded one entry at a time, each entry is
+// handed to the caller as soon as it is complete.  Nothing but the
+// current entry is kept, and the pages of the map already decoded are
+// dropped as the reader moves on, so the memory used does not grow with
+// the size of the database.
+//
+// Entries are turned into command lines the way clang's json database
+// does it for getAllCompileCommands, "arguments" as is or "command"
+// split with the platform's rules, response files expanded and the
+// target and driver mode added for prefixed compiler names.
+//
+//===----------------------------------------------------------------------===//
+#include "DBStream.h"
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/VirtualFileSystem.h"
+
+using namespace std;
+using namespace clang::tooling;
+
+// Decoded pages are given back every this many bytes
+static const size_t DropBytes = 64 << 20;
+
+// The next '"' or '\\' at or after p
+static const char *ScanString(const char *p, const char *end) {
+#if defined(__SSE2__)
+  const __m128i q = _mm_set1_epi8('"');
+  const __m128i b = _mm_set1_epi8('\\');
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int m = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, b)));
+    if (m)
+      return p + __builtin_ctz(m);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != '"' && *p != '\\')
+    p++;
+  return p;
+}
+
+namespace {
+class Reader {
+public:
+  Reader(const char *Begin, const char *End, string &Err)
+      : Begin(Begin), Dropped(Begin), p(Begin), End(End), Err(Err) {}
+
+  bool Load(DBStreamHandler &Handler);
+
+private:
+  const char *Begin, *Dropped, *p, *End;
+  string &Err;
+
+  bool Fail(const char *What) {
+    Err = string(What) + " at offset " + to_string(p - Begin);
+    return false;
+  }
+  void Space() {
+    while (p < End && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+      p++;
+  }
+  bool Next(char c) {
+    Space();
+    if (p < End && *p == c) {
+      p++;
+      return true;
+    }
+    return false;
+  }
+  bool Hex4(unsigned &u);
+  bool String(string &S);
+  bool Strings(vector<string> &L);
+  bool Skip();
+  bool Entry(CompileCommand &CC);
+  void Drop();
+};
+} // namespace
+
+bool Reader::Hex4(unsigned &u) {
+  if (End - p < 4)
+    return false;
+  u = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = *p++;
+    u <<= 4;
+    if (c >= '0' && c <= '9')
+      u |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      u |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      u |= c - 'A' + 10;
+    else
+      return false;
+  }
+  return true;
+}
+
+bool Reader::String(string &S) {
+  S.clear();
+  if (!Next('"'))
+    return Fail("Expected a string");
+  for (;;) {
+    const char *e = ScanString(p, End);
+    S.append(p, e - p);
+    p = e;
+    if (p == End)
+      return Fail("Unterminated string");
+    if (*p++ == '"')
+      return true;
+    if (p == End)
+      return Fail("Unterminated string");
+    char c = *p++;
+    switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      S += c;
+      break;
+    case 'b':
+      S += '\b';
+      break;
+    case 'f':
+      S += '\f';
+      break;
+    case 'n':
+      S += '\n';
+      break;
+    case 'r':
+      S += '\r';
+      break;
+    case 't':
+      S += '\t';
+      break;
+    case 'u': {
+      unsigned u, l;
+      if (!Hex4(u))
+        return Fail("Bad \\u escape");
+      if (u >= 0xd800 && u < 0xdc00 && End - p >= 6 && p[0] == '\\' &&
+          p[1] == 'u') {
+        p += 2;
+        if (!Hex4(l) || l < 0xdc00 || l >= 0xe000)
+          return Fail("Bad surrogate pair");
+        u = 0x10000 + ((u - 0xd800) << 10) + (l - 0xdc00);
+      }
+      if (u < 0x80) {
+        S += (char)u;
+      } else if (u < 0x800) {
+        S += (char)(0xc0 | (u >> 6));
+        S += (char)(0x80 | (u & 0x3f));
+      } else if (u < 0x10000) {
+        S += (char)(0xe0 | (u >> 12));
+        S += (char)(0x80 | ((u >> 6) & 0x3f));
+        S += (char)(0x80 | (u & 0x3f));
+      } else {
+        S += (char)(0xf0 | (u >> 18));
+        S += (char)(0x80 | ((u >> 12) & 0x3f));
+        S += (char)(0x80 | ((u >> 6) & 0x3f));
+        S += (char)(0x80 | (u & 0x3f));
+      }
+      break;
+    }
+    default:
+      return Fail("Bad escape");
+    }
+  }
+}
+
+bool Reader::Strings(vector<string> &L) {
+  L.clear();
+  if (!Next('['))
+    return Fail("Expected an array of strings");
+  if (Next(']'))
+    return true;
+  do {
+    L.emplace_back();
+    if (!String(L.back()))
+      return false;
+  } while (Next(','));
+  if (!Next(']'))
+    return Fail("Expected ']'");
+  return true;
+}
+
+// A value of a key we do not use
+bool Reader::Skip() {
+  int Depth = 0;
+  Space();
+  do {
+    if (p == End)
+      return Fail("Unexpected end of file");
+    char c = *p;
+    if (c == '"') {
+      string S;
+      if (!String(S))
+        return false;
+    } else {
+      if (c == '[' || c == '{')
+        Depth++;
+      else if (c == ']' || c == '}')
+        Depth--;
+      p++;
+      if (Depth == 0) {
+        // true, false, null or a number
+        while (p < End && *p != ',' && *p != '}' && *p != ']' && *p != ' ' &&
+               *p != '\n' && *p != '\r' && *p != '\t')
+          p++;
+      }
+    }
+    Space();
+  } while (Depth > 0);
+  return true;
+}
+
+bool Reader::Entry(CompileCommand &CC) {
+  string Key, Command;
+  bool Arguments = false;
+  CC.Directory.clear();
+  CC.Filename.clear();
+  CC.CommandLine.clear();
+  CC.Output.clear();
+
+  if (!Next('{'))
+    return Fail("Expected '{'");
+  if (!Next('}')) {
+    do {
+      if (!String(Key))
+        return false;
+      if (!Next(':'))
+        return Fail("Expected ':'");
+      bool ok;
+      if (Key == "directory") {
+        ok = String(CC.Directory);
+      } else if (Key == "file") {
+        ok = String(CC.Filename);
+      } else if (Key == "output") {
+        ok = String(CC.Output);
+      } else if (Key == "command") {
+        ok = String(Command);
+      } else if (Key == "arguments") {
+        ok = Strings(CC.CommandLine);
+        Arguments = true;
+      } else {
+        ok = Skip();
+      }
+      if (!ok)
+        return false;
+    } while (Next(','));
+    if (!Next('}'))
+      return Fail("Expected '}'");
+  }
+
+  if (CC.Directory.empty() || CC.Filename.empty())
+    return Fail("Entry without a directory or file");
+
+  llvm::BumpPtrAllocator A;
+  llvm::StringSaver Saver(A);
+  llvm::SmallVector<const char *, 64> Argv;
+  if (!Arguments) {
+#ifdef _WIN32
+    llvm::cl::TokenizeWindowsCommandLine(Command, Saver, Argv);
+#else
+    llvm::cl::TokenizeGNUCommandLine(Command, Saver, Argv);
+#endif
+  } else {
+    for (auto &a : CC.CommandLine)
+      Argv.push_back(Saver.save(a).data());
+  }
+  if (Argv.empty())
+    return Fail("Entry without a command");
+
+  bool Response = false;
+  for (auto a : Argv)
+    if (a[0] == '@')
+      Response = true;
+  if (Response) {
+#ifdef _WIN32
+    llvm::cl::TokenizerCallback Tokenizer =
+        llvm::cl::TokenizeWindowsCommandLine;
+#else
+    llvm::cl::TokenizerCallback Tokenizer = llvm::cl::TokenizeGNUCommandLine;
+#endif
+    llvm::cl::ExpandResponseFiles(Saver, Tokenizer, Argv, false, false, false,
+                                  llvm::StringRef(CC.Directory),
+                                  *llvm::vfs::getRealFileSystem());
+  }
+  if (!Arguments || Response) {
+    CC.CommandLine.clear();
+    for (auto a : Argv)
+      CC.CommandLine.push_back(a);
+  }
+  addTargetAndModeForProgramName(CC.CommandLine, CC.CommandLine.front());
+  return true;
+}
+
+// Give back the pages already decoded
+void Reader::Drop() {
+#ifndef WIN32
+  static const size_t Page = sysconf(_SC_PAGESIZE);
+  size_t n = (p - Dropped) / Page * Page;
+  if (n >= DropBytes) {
+    madvise((void *)Dropped, n, MADV_DONTNEED);
+    Dropped += n;
+  }
+#endif
+}
+
+bool Reader::Load(DBStreamHandler &Handler) {
+  CompileCommand CC;
+  if (!Next('['))
+    return Fail("Expected '['");
+  if (Next(']'))
+    return true;
+  do {
+    if (!Entry(CC))
+      return false;
+    if (!Handler(CC))
+      return true;
+    Drop();
+  } while (Next(','));
+  if (!Next(']'))
+    return Fail("Expected ']'");
+  return true;
+}
+
+bool DBStreamLoad(string &File, DBStreamHandler Handler, string &Err) {
+  bool ret = false;
+#ifndef WIN32
+  int fd = open(File.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    Err = File + " : " + strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    Err = File + " : " + strerror(errno);
+    close(fd);
+    return false;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    Err = File + " : empty";
+    return false;
+  }
+  void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    Err = File + " : " + strerror(errno);
+    return false;
+  }
+  madvise(m, st.st_size, MADV_SEQUENTIAL);
+  {
+    const char *b = (const char *)m;
+    Reader R(b, b + st.st_size, Err);
+    ret = R.Load(Handler);
+  }
+  munmap(m, st.st_size);
+#else
+  auto Buffer = llvm::MemoryBuffer::getFile(File, false, false);
+  if (!Buffer) {
+    Err = File + " : " + Buffer.getError().message();
+    return false;
+  }
+  Reader R((*Buffer)->getBufferStart(), (*Buffer)->getBufferEnd(), Err);
+  ret = R.Load(Handler);
+#endif
+  if (!ret)
+    Err = File + " : " + Err;
+  return ret;
+}
@@ -0,0 +1,24 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#ifndef DBSTREAM_H
+#define DBSTREAM_H
+
+#include <functional>
+#include <string>
+
+#include "clang/Tooling/CompilationDatabase.h"
+
+typedef std::function<bool(clang::tooling::CompileCommand &)> DBStreamHandler;
+
+bool DBStreamLoad(std::string &File, DBStreamHandler Handler,
+                  std::string &Err);
+
+#endif
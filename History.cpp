@@ -0,0 +1,132 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// Run history of per file, per stage durations.
+//
+// The history is a text file, one record per line
+//   <seconds> <tab> <stage> <tab> <script> <tab> <file>
+// Durations are smoothed across runs so a single slow run does not
+// dominate the schedule.
+//
+//===----------------------------------------------------------------------===//
+#include "History.h"
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+
+using namespace std;
+
+// script + tab + file -> stage -> seconds
+static map<string, map<string, double>> Durations;
+static mutex DurationsMutex;
+
+static string HistoryKey(string &Script, string &File) {
+  return Script + "\t" + File;
+}
+
+bool HistoryDefaultFile(string &DB, string &F) {
+  llvm::SmallString<128> C;
+  if (!llvm::sys::path::cache_directory(C))
+    return false;
+  boost::filesystem::path D = boost::filesystem::path(C.str().str()) / "s2s";
+  boost::system::error_code EC;
+  boost::filesystem::create_directories(D, EC);
+  if (EC)
+    return false;
+  llvm::MD5 H;
+  llvm::MD5::MD5Result R;
+  llvm::SmallString<32> Hex;
+  H.update(DB);
+  H.final(R);
+  llvm::MD5::stringifyResult(R, Hex);
+  F = (D / ("history-" + Hex.str().str())).string();
+  return true;
+}
+
+bool HistoryLoad(string &F) {
+  bool ret = false;
+  ifstream in(F);
+  if (in) {
+    lock_guard<mutex> lock(DurationsMutex);
+    string line;
+    while (getline(in, line)) {
+      size_t a = line.find('\t');
+      if (a == string::npos)
+        continue;
+      size_t b = line.find('\t', a + 1);
+      if (b == string::npos)
+        continue;
+      double seconds = atof(line.substr(0, a).c_str());
+      string stage = line.substr(a + 1, b - a - 1);
+      Durations[line.substr(b + 1)][stage] = seconds;
+    }
+    ret = true;
+  }
+  return ret;
+}
+
+bool HistorySave(string &F) {
+  bool ret = false;
+  // Other runs on the same database save the same history, each writes
+  // its own temp file beside it
+  string T = F + boost::filesystem::unique_path(".%%%%-%%%%-%%%%-%%%%.tmp")
+                     .string();
+  {
+    ofstream out(T, ios::trunc);
+    if (out) {
+      lock_guard<mutex> lock(DurationsMutex);
+      for (auto &d : Durations)
+        for (auto &s : d.second)
+          out << s.second << "\t" << s.first << "\t" << d.first << "\n";
+      ret = out.good();
+    }
+  }
+  boost::system::error_code EC;
+  if (ret) {
+    boost::filesystem::rename(T, F, EC);
+    if (EC)
+      ret = false;
+  }
+  if (!ret)
+    boost::filesystem::remove(T, EC);
+  return ret;
+}
+
+void HistoryRecord(string &Script, string &File, const char *Stage,
+                   double Seconds) {
+  lock_guard<mutex> lock(DurationsMutex);
+  auto &stages = Durations[HistoryKey(Script, File)];
+  auto s = stages.find(Stage);
+  if (s == stages.end())
+    stages[Stage] = Seconds;
+  else
+    s->second = (s->second + Seconds) / 2.0;
+}
+
+bool HistoryCost(string &Script, string &File, double &Seconds) {
+  bool ret = false;
+  lock_guard<mutex> lock(DurationsMutex);
+  auto d = Durations.find(HistoryKey(Script, File));
+  if (d != Durations.end()) {
+    Seconds = 0.0;
+    for (auto &s : d->second)
+      Seconds += s.second;
+    ret = true;
+  }
+  return ret;
+}
@@ -0,0 +1,25 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <string>
+
+// The history for the database in directory DB, in the user's cache
+// directory rather than the build tree
+bool HistoryDefaultFile(std::string &DB, std::string &F);
+bool HistoryLoad(std::string &F);
+bool HistorySave(std::string &F);
+void HistoryRecord(std::string &Script, std::string &File, const char *Stage,
+                   double Seconds);
+bool HistoryCost(std::string &Script, std::string &File, double &Seconds);
+
+#endif
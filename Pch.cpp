@@ -0,0 +1,254 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// Precompiled headers for -fsyntax-only test stages.
+//
+// The test stages of most scripts check every edited file with the
+// compiler's -fsyntax-only, which parses the same system and project
+// headers over and over.  The first file checked with a given compiler
+// and set of flags has the #include lines at its top written to a header
+// and precompiled.  Later files with the same flags whose includes start
+// with the same lines get the header forced in with -include, which the
+// compiler satisfies from the precompiled header.  Their own #includes
+// of those headers are then skipped by the include guards.
+//
+// Anything else falls back to the plain command line.
+//
+//===----------------------------------------------------------------------===//
+#include "Pch.h"
+#include "Process.h"
+#include "TempFile.h"
+#include <algorithm>
+#include <ctype.h>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+enum PchState { PCH_BUILDING, PCH_READY, PCH_FAILED };
+
+struct Pch {
+  PchState State;
+  vector<string> Includes;
+  string Header;
+  string Output;
+};
+
+// compiler, language and flags -> pch
+static map<string, Pch> Pchs;
+static mutex PchsMutex;
+
+static bool IsSyntaxOnly(vector<string> &OCL) {
+  return find(OCL.begin(), OCL.end(), "-fsyntax-only") != OCL.end();
+}
+
+static bool IsClang(string &Exe) {
+  string f = boost::filesystem::path(Exe).filename().string();
+  return f.find("clang") != string::npos;
+}
+
+// The flags of the test command line without the input, output and
+// language, those are what the pch has to agree with.
+static void PchFlags(vector<string> &OCL, string &IF, vector<string> &Flags,
+                     string &Lang) {
+  Lang.clear();
+  for (size_t i = 1; i < OCL.size(); i++) {
+    string &a = OCL[i];
+    if (a == IF || a == "-fsyntax-only")
+      continue;
+    if ((a == "-o" || a == "-x") && i + 1 < OCL.size()) {
+      if (a == "-x")
+        Lang = OCL[i + 1];
+      i++;
+      continue;
+    }
+    Flags.push_back(a);
+  }
+  if (Lang == "") {
+    if (boost::filesystem::extension(IF) == ".c")
+      Lang = "c";
+    else
+      Lang = "c++";
+  }
+}
+
+static string PchKey(string &Exe, string &Lang, vector<string> &Flags) {
+  string k = Exe + '\0' + Lang;
+  for (auto &f : Flags)
+    k += '\0' + f;
+  return k;
+}
+
+// The #include <..> and #include ".." lines at the top of the file,
+// skipping blank lines and comments.  Stops at anything else, a
+// #define or #if may change what the following includes mean.
+static void PchIncludes(string &F, vector<string> &Includes) {
+  ifstream in(F);
+  string line;
+  bool comment = false;
+  while (getline(in, line)) {
+    size_t i = 0, n = line.size();
+    string directive;
+    while (i < n) {
+      if (comment) {
+        size_t e = line.find("*/", i);
+        if (e == string::npos) {
+          i = n;
+        } else {
+          comment = false;
+          i = e + 2;
+        }
+      } else if (isspace((unsigned char)line[i])) {
+        i++;
+      } else if (line.compare(i, 2, "/*") == 0) {
+        comment = true;
+        i += 2;
+      } else if (line.compare(i, 2, "//") == 0) {
+        i = n;
+      } else if (directive == "" && line[i] == '#') {
+        size_t j = i + 1;
+        while (j < n && isspace((unsigned char)line[j]))
+          j++;
+        if (line.compare(j, 7, "include") != 0)
+          return;
+        j += 7;
+        while (j < n && isspace((unsigned char)line[j]))
+          j++;
+        if (j == n || (line[j] != '<' && line[j] != '"'))
+          return;
+        size_t e = line.find(line[j] == '<' ? '>' : '"', j + 1);
+        if (e == string::npos)
+          return;
+        directive = line.substr(j, e - j + 1);
+        i = e + 1;
+      } else {
+        return;
+      }
+    }
+    if (directive.size())
+      Includes.push_back(directive);
+  }
+}
+
+static bool PchBuild(Pch &P, string &Exe, string &Lang,
+                     vector<string> &Flags) {
+  bool ret = false;
+  // Shared by the jobs, so not in the directory of this one
+  TempFileRunName(".h", P.Header);
+  if (P.Header.size()) {
+    ofstream out(P.Header);
+    for (auto &i : P.Includes)
+      out << "#include " << i << "\n";
+    out.close();
+    if (out) {
+      // Where -include looks for the precompiled header
+      P.Output = P.Header + (IsClang(Exe) ? ".pch" : ".gch");
+      vector<string> PCL;
+      PCL.push_back(Exe);
+      for (auto &f : Flags)
+        PCL.push_back(f);
+      PCL.push_back("-x");
+      PCL.push_back(Lang + "-header");
+      PCL.push_back(P.Header);
+      PCL.push_back("-o");
+      PCL.push_back(P.Output);
+      if (Process(PCL) == 0)
+        ret = true;
+    }
+  }
+  return ret;
+}
+
+bool PchCommandLine(vector<string> &OCL, string &IF, vector<string> &PCL) {
+  if (OCL.empty() || !IsSyntaxOnly(OCL))
+    return false;
+
+  vector<string> Flags, Includes;
+  string Lang;
+  PchFlags(OCL, IF, Flags, Lang);
+  PchIncludes(IF, Includes);
+  if (Includes.empty())
+    return false;
+
+  string Key = PchKey(OCL[0], Lang, Flags);
+  Pch *P;
+  bool Build = false;
+  {
+    lock_guard<mutex> lock(PchsMutex);
+    auto i = Pchs.find(Key);
+    if (i == Pchs.end()) {
+      P = &Pchs[Key];
+      P->State = PCH_BUILDING;
+      P->Includes = Includes;
+      Build = true;
+    } else {
+      // Another job may still be building it, do not wait
+      if (i->second.State != PCH_READY)
+        return false;
+      P = &i->second;
+    }
+  }
+
+  if (Build) {
+    bool built = PchBuild(*P, OCL[0], Lang, Flags);
+    lock_guard<mutex> lock(PchsMutex);
+    P->State = built ? PCH_READY : PCH_FAILED;
+    if (!built)
+      return false;
+  }
+
+  if (Includes.size() < P->Includes.size() ||
+      !equal(P->Includes.begin(), P->Includes.end(), Includes.begin()))
+    return false;
+
+  PCL.clear();
+  PCL.push_back(OCL[0]);
+  PCL.push_back("-include");
+  PCL.push_back(P->Header);
+  for (size_t i = 1; i < OCL.size(); i++)
+    PCL.push_back(OCL[i]);
+  return true;
+}
+
+// The test failed with the pch and passed without it, stop using it
+void PchFailed(vector<string> &OCL, string &IF) {
+  vector<string> Flags;
+  string Lang;
+  PchFlags(OCL, IF, Flags, Lang);
+  string Key = PchKey(OCL[0], Lang, Flags);
+  lock_guard<mutex> lock(PchsMutex);
+  auto i = Pchs.find(Key);
+  if (i != Pchs.end())
+    i->second.State = PCH_FAILED;
+}
+
+void PchCleanup(bool Keep) {
+  lock_guard<mutex> lock(PchsMutex);
+  for (auto &i : Pchs) {
+    Pch &P = i.second;
+    if (Keep) {
+      if (P.Output.size())
+        fprintf(stdout, "PCH temp file %s\n", P.Output.c_str());
+    } else {
+      if (P.Header.size())
+        TempFileRemove(P.Header);
+      if (P.Output.size())
+        TempFileRemove(P.Output);
+    }
+  }
+  Pchs.clear();
+}
@@ -0,0 +1,22 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#ifndef PCH_H
+#define PCH_H
+
+#include <string>
+#include <vector>
+
+bool PchCommandLine(std::vector<std::string> &OCL, std::string &IF,
+                    std::vector<std::string> &PCL);
+void PchFailed(std::vector<std::string> &OCL, std::string &IF);
+void PchCleanup(bool Keep);
+
+#endif
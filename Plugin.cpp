@@ -0,0 +1,60 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#include "Plugin.h"
+#include <algorithm>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+using namespace std;
+
+S2SPlugin Plugin;
+
+bool PluginLoad(string &File, string &Err) {
+  S2SPluginEntry Entry = nullptr;
+#ifdef WIN32
+  HMODULE H = LoadLibraryA(File.c_str());
+  if (H == NULL) {
+    Err = "could not load " + File;
+    return false;
+  }
+  Entry = (S2SPluginEntry)GetProcAddress(H, S2S_PLUGIN_ENTRY);
+#else
+  // Never closed, the hooks are used to the end of the run
+  void *H = dlopen(File.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (H == nullptr) {
+    Err = dlerror();
+    return false;
+  }
+  Entry = (S2SPluginEntry)dlsym(H, S2S_PLUGIN_ENTRY);
+#endif
+  if (Entry == nullptr) {
+    Err = File + " has no " S2S_PLUGIN_ENTRY "()";
+    return false;
+  }
+
+  const S2SPlugin *P = Entry();
+  if (P == nullptr || P->Version == 0 || P->Version > S2S_PLUGIN_VERSION ||
+      P->Size < offsetof(S2SPlugin, FilterDBEntry)) {
+    Err = File + " was built for another version of s2s";
+    return false;
+  }
+  // An older plugin is shorter, the hooks it does not have stay null
+  memset(&Plugin, 0, sizeof(Plugin));
+  memcpy(&Plugin, P, min<size_t>(P->Size, sizeof(Plugin)));
+  return true;
+}
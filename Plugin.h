@@ -0,0 +1,76 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// The hooks of a script, compiled into a shared object loaded with
+// -plugin=<file>.  See plugin/example.cpp.
+//
+// The plugin exports s2s_plugin(), returning a table of the hooks with the
+// version of this header it was built with.  Any hook may be null, the
+// script's function of the same name is called instead, so a plugin can
+// take over the hot hooks and leave the rest to lua.  The hooks are
+// called from every worker thread at once.
+//
+// Hooks are only ever added to the end of S2SPlugin, each addition bumps
+// S2S_PLUGIN_VERSION.  A plugin built with an older header is loaded with
+// the hooks it does not know about left to the script.  The hooks pass
+// std:: types, build the plugin with the compiler and standard library
+// s2s was built with.
+//
+//===----------------------------------------------------------------------===//
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include <string>
+#include <vector>
+
+#define S2S_PLUGIN_VERSION 1
+
+struct S2SPlugin {
+  // S2S_PLUGIN_VERSION and sizeof(S2SPlugin) the plugin was built with
+  unsigned Version;
+  unsigned Size;
+  const char *Name;
+
+  bool (*FilterDBEntry)(std::vector<std::string> &ICL, std::string &IF,
+                        std::string &ID, std::string &Exe);
+  bool (*GetTestConfigurations)(std::vector<std::string> &TC, std::string &X,
+                                std::string &E);
+  bool (*GetTestStages)(std::vector<std::string> &TS, std::string &TC);
+  bool (*GetTestCommandLine)(std::vector<std::string> &OCL,
+                             std::vector<std::string> &ICL, std::string &TC,
+                             std::string &TS, std::string &IF,
+                             std::string &OF, std::string &Exe);
+  bool (*GetTestExtension)(std::string &E, std::string &TS);
+  bool (*IsTestOk)(int &I, std::string &TS);
+  bool (*GetS2SCommandLine)(std::vector<std::string> &OCL,
+                            std::vector<std::string> &ICL, std::string &IF,
+                            std::string &OF, std::string &Exe);
+  bool (*GetS2SExtension)(std::string &E);
+  bool (*IsS2SOk)(int &I);
+  bool (*GetEditorCommandLine)(std::vector<std::string> &OCL,
+                               std::vector<std::string> &ICL, std::string &IF,
+                               std::string &OF, std::string &Exe);
+  bool (*GetEditorExtension)(std::string &E);
+  bool (*IsEditorOk)(int &I);
+  bool (*IsOverWriteOk)();
+  bool (*GetDiffCommandLine)(std::vector<std::string> &OCL, std::string &AF,
+                             std::string &BF);
+  bool (*IsDiffOk)(int &I);
+};
+
+typedef const S2SPlugin *(*S2SPluginEntry)();
+#define S2S_PLUGIN_ENTRY "s2s_plugin"
+
+// The loaded plugin's hooks, all null without one
+extern S2SPlugin Plugin;
+bool PluginLoad(std::string &File, std::string &Err);
+
+#endif
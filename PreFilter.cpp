@@ -0,0 +1,216 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// Command line filters of the database, run before the script's
+// FilterDBEntry.  An entry has to match every filter that is set, so a run
+// over a few files of a large database makes a lua call for those few
+// entries only.
+//
+//===----------------------------------------------------------------------===//
+#include "PreFilter.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+
+// A glob on a path, matched a component at a time so * and ? never match
+// a /.  A ** component matches any number of components.  A glob without
+// a / is matched against the file's name, one starting with / against its
+// absolute path and any other against its path relative to the -db
+// directory or to the entry's directory.
+struct PathGlob {
+  enum { NAME, ABSOLUTE, RELATIVE } Kind;
+  vector<GlobPattern> Parts;
+  vector<bool> AnyDepth;
+};
+
+static vector<PathGlob> Includes, Excludes;
+static vector<GlobPattern> Compilers;
+static unique_ptr<Regex> FileRegex, DirectoryRegex;
+static vector<string> Extensions;
+static string Root;
+static bool Active = false;
+
+static void Split(StringRef P, SmallVectorImpl<StringRef> &C) {
+  SmallVector<StringRef, 16> A;
+  P.split(A, '/');
+  for (auto &a : A)
+    if (a.size())
+      C.push_back(a);
+}
+
+static bool Globs(vector<string> &P, vector<GlobPattern> &G, string &Err) {
+  G.clear();
+  for (auto &p : P) {
+    Expected<GlobPattern> g = GlobPattern::create(p);
+    if (!g) {
+      Err = p + " : " + toString(g.takeError());
+      return false;
+    }
+    G.push_back(std::move(*g));
+  }
+  return true;
+}
+
+static bool PathGlobs(vector<string> &P, vector<PathGlob> &G, string &Err) {
+  G.clear();
+  for (auto &p : P) {
+    PathGlob g;
+    StringRef S(p);
+    if (S.find('/') == StringRef::npos)
+      g.Kind = PathGlob::NAME;
+    else if (S.startswith("/"))
+      g.Kind = PathGlob::ABSOLUTE;
+    else
+      g.Kind = PathGlob::RELATIVE;
+    SmallVector<StringRef, 16> C;
+    Split(S, C);
+    for (auto &c : C) {
+      // A ** component has a pattern only to keep the lists in step
+      bool Any = c == "**";
+      Expected<GlobPattern> Part = GlobPattern::create(Any ? "*" : c);
+      if (!Part) {
+        Err = p + " : " + toString(Part.takeError());
+        return false;
+      }
+      g.Parts.push_back(std::move(*Part));
+      g.AnyDepth.push_back(Any);
+    }
+    G.push_back(std::move(g));
+  }
+  return true;
+}
+
+static bool Compile(string &P, unique_ptr<Regex> &R, string &Err) {
+  R.reset();
+  if (P.empty())
+    return true;
+  R.reset(new Regex(P));
+  string E;
+  if (!R->isValid(E)) {
+    Err = P + " : " + E;
+    return false;
+  }
+  return true;
+}
+
+static bool Any(vector<GlobPattern> &G, StringRef S) {
+  for (auto &g : G)
+    if (g.match(S))
+      return true;
+  return false;
+}
+
+static bool Match(PathGlob &G, size_t i, ArrayRef<StringRef> C) {
+  if (i == G.Parts.size())
+    return C.empty();
+  if (G.AnyDepth[i]) {
+    for (size_t n = 0; n <= C.size(); n++)
+      if (Match(G, i + 1, C.drop_front(n)))
+        return true;
+    return false;
+  }
+  return C.size() && G.Parts[i].match(C[0]) && Match(G, i + 1, C.drop_front());
+}
+
+// The components of Path below Dir, false if it is not below it
+static bool Below(StringRef Path, StringRef Dir,
+                  SmallVectorImpl<StringRef> &C) {
+  if (Dir.empty() || !Path.startswith(Dir))
+    return false;
+  StringRef R = Path.drop_front(Dir.size());
+  if (!Dir.endswith("/") && !R.startswith("/"))
+    return false;
+  Split(R, C);
+  return true;
+}
+
+static string Normal(StringRef P) {
+  SmallString<256> N(P);
+  sys::path::remove_dots(N, true);
+  return N.str().str();
+}
+
+static bool Any(vector<PathGlob> &G, string &File, string &Directory) {
+  string F = Normal(File);
+  SmallVector<StringRef, 16> A, FromRoot, FromDirectory;
+  Split(F, A);
+  bool InRoot = Below(F, Root, FromRoot);
+  bool InDirectory = Below(F, Normal(Directory), FromDirectory);
+  for (auto &g : G) {
+    switch (g.Kind) {
+    case PathGlob::NAME:
+      if (A.size() && g.Parts[0].match(A.back()))
+        return true;
+      break;
+    case PathGlob::ABSOLUTE:
+      if (Match(g, 0, A))
+        return true;
+      break;
+    case PathGlob::RELATIVE:
+      if ((InRoot && Match(g, 0, FromRoot)) ||
+          (InDirectory && Match(g, 0, FromDirectory)))
+        return true;
+      break;
+    }
+  }
+  return false;
+}
+
+bool PreFilterInit(PreFilterOptions &O, string &Err) {
+  if (!PathGlobs(O.IncludePaths, Includes, Err) ||
+      !PathGlobs(O.ExcludePaths, Excludes, Err) ||
+      !Globs(O.Compilers, Compilers, Err) ||
+      !Compile(O.FileRegex, FileRegex, Err) ||
+      !Compile(O.DirectoryRegex, DirectoryRegex, Err))
+    return false;
+  Root = O.Root.size() ? Normal(O.Root) : "";
+  Extensions.clear();
+  for (auto &e : O.Extensions)
+    Extensions.push_back(e.size() && e[0] != '.' ? "." + e : e);
+  Active = Includes.size() || Excludes.size() || Compilers.size() ||
+           FileRegex || DirectoryRegex || Extensions.size();
+  return true;
+}
+
+bool PreFilterActive() { return Active; }
+
+bool PreFilterKeep(string &File, string &Directory, string &Exe) {
+  if (!Active)
+    return true;
+  if (Extensions.size()) {
+    StringRef X = sys::path::extension(File);
+    bool Found = false;
+    for (auto &e : Extensions)
+      if (X == e)
+        Found = true;
+    if (!Found)
+      return false;
+  }
+  if (Compilers.size() && !Any(Compilers, sys::path::filename(Exe)))
+    return false;
+  if (Includes.size() && !Any(Includes, File, Directory))
+    return false;
+  if (Excludes.size() && Any(Excludes, File, Directory))
+    return false;
+  if (FileRegex && !FileRegex->match(File))
+    return false;
+  if (DirectoryRegex && !DirectoryRegex->match(Directory))
+    return false;
+  return true;
+}
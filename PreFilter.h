@@ -0,0 +1,34 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+#include <string>
+#include <vector>
+
+// Patterns database entries have to match before the script's filter
+// sees them.  Empty lists match everything.
+struct PreFilterOptions {
+  std::vector<std::string> IncludePaths, ExcludePaths; // globs on the file
+  std::string Root; // the -db directory, relative path globs start here
+  std::string FileRegex, DirectoryRegex;
+  std::vector<std::string> Compilers;  // globs on the compiler's basename
+  std::vector<std::string> Extensions; // of the file, with or without a .
+};
+
+bool PreFilterInit(PreFilterOptions &O, std::string &Err);
+// Whether any pre-filter is set
+bool PreFilterActive();
+// File is the absolute path of the entry's file
+bool PreFilterKeep(std::string &File, std::string &Directory,
+                   std::string &Exe);
+
+#endif
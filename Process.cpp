@@ -8,22 +8,42 @@
 // Copyright Tom Rix 2019, all rights reserved.
 //
 //===----------------------------------------------------------------------===//
+#include "Builtin.h"
+#include "Process.h"
 #include "TempFile.h"
 #include "Thread.h"
 #include <algorithm>
 #include <assert.h>
+#include <chrono>
 #include <errno.h>
 #include <iostream>
 #include <string>
 #ifdef WIN32
 #include <windows.h>
 #else
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #endif
 #include <vector>
 using namespace std;
 
+#ifndef WIN32
+extern char **environ;
+#endif
+
+static bool Echo = true;
+// Set while ProcessCapture runs on this thread
+static thread_local bool Quiet = false;
+
+static bool Echoed() { return Echo && !Quiet; }
+
 #ifdef WIN32
 static void ReportCreateProcessError(LPSTR commandLine) {
   DWORD lastError;
@@ -60,15 +80,484 @@ static void DebugIOThreadExitCode(DWORD size, HANDLE *handles) {
 #else
 #define DebugIOThreadExitCode(a, b)
 #endif
+#else
+// Pipes are created close-on-exec so children started concurrently by
+// other jobs do not inherit them and hold them open.
+static int CloexecPipe(int fd[2]) {
+#ifdef __linux__
+  return pipe2(fd, O_CLOEXEC);
+#else
+  int ret = pipe(fd);
+  if (ret == 0) {
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+  }
+  return ret;
 #endif
+}
 
-static int _Process(vector<string> &A, string &StdIn, string &StdOut,
-                    string &StdErr) {
-  int ret = -1;
+static ProcessSpawn Spawn = SPAWN_POSIX_SPAWN;
+
+static void IgnoreSigpipe() {
+  // The editor may exit without reading all of the relayed output, the
+  // write error is handled where it happens.  Children are started with
+  // the default action.
+  static bool ignored = (signal(SIGPIPE, SIG_IGN), true);
+  (void)ignored;
+}
+
+// Output the parent relays from a child.  The data read from fd is
+// written to file and echoed to echo.  Closed descriptors are -1.
+// When the echo goes to the stdin of another child it is owned by the
+// stream and may not block the relay.
+struct Stream {
+  int fd;
+  int file;
+  int echo;
+  bool own;
+  bool tee;
+  bool blocked;
+};
+
+// A running child and the streams relayed from it
+struct Child {
+  pid_t pid;
+  int pidfd;
+  Stream out, err;
+  int status;
+  bool exited;
+  bool stopped;
+  // Started in a process group of its own, so it can be stopped along
+  // with the processes it started
+  bool group = false;
+};
+
+static void CloseFd(int &fd) {
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+static void SetNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void StreamInit(Stream &S) {
+  S.fd = S.file = S.echo = -1;
+  S.own = S.tee = S.blocked = false;
+}
+
+static void StreamClose(Stream &S) {
+  CloseFd(S.fd);
+  CloseFd(S.file);
+  if (S.own)
+    CloseFd(S.echo);
+  S.echo = -1;
+}
+
+// A pidfd becomes readable when the child exits, so the exit can be
+// waited on in the same poll as the child's i/o.
+static int PidOpen(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+static int OpenCapture(string &F) {
+  int file = open(F.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (file == -1)
+    perror(F.c_str());
+  return file;
+}
+
+// Decide where one of the child's output streams goes and return the
+// descriptor the child should write to.  When nothing is echoed the
+// child writes straight into its capture file.  Only a stream that is
+// both captured and echoed is relayed by the parent.
+static int ChildSink(string &F, int Std, Stream &S) {
+  int fd = -1;
+  StreamInit(S);
+  if (F.size()) {
+    int file = OpenCapture(F);
+    if (file == -1) {
+    } else if (!Echoed()) {
+      fd = file;
+    } else {
+      int relay_pipe[2];
+      if (CloexecPipe(relay_pipe) == 0) {
+        // Only a pipe can take a tee of the relayed output
+        struct stat st;
+        S.fd = relay_pipe[0];
+        S.file = file;
+        S.echo = STDOUT_FILENO;
+        S.tee = fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+        fd = relay_pipe[1];
+      } else {
+        close(file);
+      }
+    }
+  } else if (Echoed()) {
+    fd = fcntl(Std, F_DUPFD_CLOEXEC, 3);
+  } else {
+    fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  }
+  return fd;
+}
+
+// Start A with its stdin, stdout and stderr on the descriptors in fds.
+// The descriptors stay with the caller.
+static pid_t ChildSpawn(vector<string> &A, int fds[3], bool Group) {
   std::vector<const char *> Argv(A.size() + 1);
   std::transform(A.begin(), A.end(), Argv.begin(),
                  [](std::string &str) { return str.c_str(); });
 
+  pid_t pid = -1;
+  if (Spawn == SPAWN_POSIX_SPAWN) {
+    // posix_spawn does not copy the driver's address space, which with
+    // all of llvm and clang linked in is what a fork spends its time on.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    // The descriptors are close on exec, the dup'ed ones are not
+    posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[2], STDERR_FILENO);
+    // SIGPIPE is ignored by -server and the pipeline relay, an ignored
+    // signal would otherwise be inherited by the tools
+    posix_spawnattr_t attr;
+    sigset_t def;
+    posix_spawnattr_init(&attr);
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    if (Group) {
+      posix_spawnattr_setpgroup(&attr, 0);
+      flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    int spawn_status =
+        posix_spawnp(&pid, Argv[0], &actions, &attr,
+                     const_cast<char **>(Argv.data()), environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (spawn_status != 0) {
+      fprintf(stderr, "Problem with exec of %s\n", Argv[0]);
+      fprintf(stderr, "%s\n", strerror(spawn_status));
+      fflush(stderr);
+      pid = -1;
+    }
+  } else {
+    pid = fork();
+    if (pid == -1) {
+      perror("fork");
+      fflush(stderr);
+    } else if (pid == 0) {
+      /* child */
+      int exec_status;
+
+      dup2(fds[0], STDIN_FILENO);
+      dup2(fds[1], STDOUT_FILENO);
+      dup2(fds[2], STDERR_FILENO);
+      signal(SIGPIPE, SIG_DFL);
+      if (Group)
+        setpgid(0, 0);
+
+      //
+      // DEBUGGING
+      // Print out the command line
+      // for (auto a : A)
+      //  std::cout << a << " ";
+      // std::cout << std::endl;
+
+      exec_status = execvp(Argv[0], const_cast<char **>(Argv.data()));
+      if (exec_status < 0) {
+        fprintf(stderr, "Problem with exec of %s\n", Argv[0]);
+        perror("");
+      }
+      _exit(1); /* no flush                             */
+    }
+    // Also in the parent, the group has to exist before it is signalled
+    if (pid > 0 && Group)
+      setpgid(pid, pid);
+  }
+  return pid;
+}
+
+// Start the child on the prepared descriptors and close them.
+static bool ChildLaunch(Child &C, vector<string> &A, int fds[3]) {
+  C.pid = -1;
+  C.pidfd = -1;
+  C.status = -1;
+  C.exited = false;
+  C.stopped = false;
+
+  if (fds[0] != -1 && fds[1] != -1 && fds[2] != -1)
+    C.pid = ChildSpawn(A, fds, C.group);
+
+  // Close the child's ends so its exit shows up as end of file
+  for (unsigned i = 0; i < 3; i++)
+    CloseFd(fds[i]);
+
+  if (C.pid == -1) {
+    StreamClose(C.out);
+    StreamClose(C.err);
+    fflush(stderr);
+    return false;
+  }
+
+  C.pidfd = PidOpen(C.pid);
+  if (C.out.fd != -1)
+    SetNonBlocking(C.out.fd);
+  if (C.err.fd != -1)
+    SetNonBlocking(C.err.fd);
+  return true;
+}
+
+static int ChildInput(string &StdIn) {
+  int fd;
+  if (StdIn.size()) {
+    fd = open(StdIn.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      perror(StdIn.c_str());
+  } else {
+    fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+  return fd;
+}
+
+static bool ChildStart(Child &C, vector<string> &A, string &StdIn,
+                       string &StdOut, string &StdErr) {
+  int fds[3];
+  fds[0] = ChildInput(StdIn);
+  fds[1] = ChildSink(StdOut, STDOUT_FILENO, C.out);
+  fds[2] = ChildSink(StdErr, STDERR_FILENO, C.err);
+  return ChildLaunch(C, A, fds);
+}
+
+static bool WriteAll(int fd, const char *buffer, ssize_t count) {
+  while (count > 0) {
+    ssize_t written = write(fd, buffer, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    buffer += written;
+    count -= written;
+  }
+  return true;
+}
+
+// Copy what is in the relay pipe to the capture file and echo it.
+static void StreamRead(Stream &S) {
+#ifdef __linux__
+  if (S.echo == -1) {
+    ssize_t count = splice(S.fd, nullptr, S.file, nullptr, 1 << 20,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (count > 0 || (count < 0 && (errno == EAGAIN || errno == EINTR)))
+      return;
+    if (count == 0) {
+      StreamClose(S);
+      return;
+    }
+  }
+  if (S.tee) {
+    // Duplicate the data into the echo pipe, then move it into the
+    // capture file, without it ever being copied to user space.
+    ssize_t count = tee(S.fd, S.echo, 1 << 20, SPLICE_F_NONBLOCK);
+    if (count > 0) {
+      while (count > 0) {
+        ssize_t moved =
+            splice(S.fd, nullptr, S.file, nullptr, count, SPLICE_F_MOVE);
+        if (moved <= 0)
+          break;
+        count -= moved;
+      }
+      return;
+    } else if (count == 0) {
+      StreamClose(S);
+      return;
+    } else if (errno == EINTR) {
+      return;
+    } else if (errno == EAGAIN && S.own) {
+      // The child reading the echo is behind, wait for it to catch up
+      S.blocked = true;
+      return;
+    } else if (errno == EPIPE && S.own) {
+      // The child reading the echo is gone, keep the capture
+      CloseFd(S.echo);
+      S.tee = false;
+      return;
+    }
+    // Our stdout is full or will not take a tee, copy instead
+    S.tee = false;
+  }
+#endif
+  static thread_local char buffer[1 << 16];
+  ssize_t count = read(S.fd, buffer, sizeof(buffer));
+  if (count > 0) {
+    WriteAll(S.file, buffer, count);
+    if (S.echo != -1 && !WriteAll(S.echo, buffer, count) && errno == EPIPE &&
+        S.own)
+      // The child reading the echo is gone, keep the capture
+      CloseFd(S.echo);
+  } else if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+    StreamClose(S);
+  }
+}
+
+static bool ChildDone(Child &C) {
+  return C.exited && C.out.fd == -1 && C.err.fd == -1;
+}
+
+static void ChildFinish(Child &C) {
+  StreamClose(C.out);
+  StreamClose(C.err);
+}
+
+// Exited with a failure, or killed
+static bool ChildFailed(Child &C) {
+  return C.exited && (!WIFEXITED(C.status) || WEXITSTATUS(C.status) != 0);
+}
+
+// Wait for all of the children from this thread.  The loop blocks in poll
+// until there is output to relay or a child exits.  Children without a
+// pidfd are reaped on a short poll timeout instead.  With StopOnFailure
+// the first child to fail has the others that are still running
+// terminated, a child in its own group together with its group.
+static void ChildrenWait(vector<Child *> &Children, bool StopOnFailure) {
+  enum { CHILD_OUT, CHILD_ERR, CHILD_PID };
+  vector<struct pollfd> fds;
+  vector<pair<Child *, int>> owners;
+
+  fflush(stdout);
+  do {
+    bool pending = false, drain = false, reap = false;
+    fds.clear();
+    owners.clear();
+    for (auto C : Children) {
+      if (ChildDone(*C))
+        continue;
+      pending = true;
+      struct pollfd p = {-1, POLLIN, 0};
+      Stream *streams[2] = {&C->out, &C->err};
+      for (int s = 0; s < 2; s++) {
+        Stream *S = streams[s];
+        if (S->fd == -1)
+          continue;
+        if (S->blocked) {
+          p.fd = S->echo;
+          p.events = POLLOUT;
+        } else {
+          p.fd = S->fd;
+          p.events = POLLIN;
+        }
+        fds.push_back(p);
+        owners.push_back(make_pair(C, s == 0 ? CHILD_OUT : CHILD_ERR));
+      }
+      p.events = POLLIN;
+      if (C->exited) {
+        // Only collect what is already buffered, a grandchild may be
+        // holding the pipes open.  A stream waiting on a slow reader
+        // still has to be delivered.
+        if (!C->out.blocked && !C->err.blocked)
+          drain = true;
+      } else if (C->pidfd != -1) {
+        p.fd = C->pidfd;
+        fds.push_back(p);
+        owners.push_back(make_pair(C, CHILD_PID));
+      } else {
+        reap = true;
+      }
+    }
+    if (!pending)
+      break;
+
+    int timeout = -1;
+    if (drain)
+      timeout = 0;
+    else if (reap)
+      timeout = 10;
+
+    int poll_status = poll(fds.data(), fds.size(), timeout);
+    if (poll_status < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      fflush(stderr);
+      for (auto C : Children) {
+        if (!C->exited && C->pid > 0)
+          waitpid(C->pid, &C->status, 0);
+        C->exited = true;
+        CloseFd(C->pidfd);
+        ChildFinish(*C);
+      }
+      break;
+    }
+
+    for (auto C : Children)
+      if (C->exited && !ChildDone(*C)) {
+        bool busy = C->out.blocked || C->err.blocked;
+        for (size_t i = 0; i < fds.size(); i++)
+          if (owners[i].first == C && fds[i].revents)
+            busy = true;
+        if (!busy)
+          ChildFinish(*C);
+      }
+
+    for (size_t i = 0; i < fds.size(); i++) {
+      if (fds[i].revents == 0)
+        continue;
+      Child *C = owners[i].first;
+      switch (owners[i].second) {
+      case CHILD_OUT:
+      case CHILD_ERR: {
+        Stream &S = owners[i].second == CHILD_OUT ? C->out : C->err;
+        if (S.blocked)
+          S.blocked = false;
+        else if (S.fd != -1)
+          StreamRead(S);
+        break;
+      }
+      case CHILD_PID:
+        if (waitpid(C->pid, &C->status, 0) == C->pid)
+          C->exited = true;
+        CloseFd(C->pidfd);
+        break;
+      }
+    }
+
+    for (auto C : Children)
+      if (!C->exited && C->pidfd == -1)
+        if (waitpid(C->pid, &C->status, WNOHANG) == C->pid)
+          C->exited = true;
+
+    if (StopOnFailure)
+      for (auto C : Children)
+        if (ChildFailed(*C) && !C->stopped) {
+          StopOnFailure = false;
+          // A compiler driver's cc1 is in its group
+          for (auto O : Children)
+            if (O->pid > 0 && (!O->exited || O->group)) {
+              kill(O->group ? -O->pid : O->pid, SIGTERM);
+              O->stopped = O->stopped || !O->exited;
+            }
+          break;
+        }
+  } while (1);
+
+  for (auto C : Children)
+    ChildFinish(*C);
+}
+#endif
+
+static int _Process(vector<string> &A, string &StdIn, string &StdOut,
+                    string &StdErr) {
+  int ret = -1;
+#ifdef WIN32
   std::string Args;
   for (auto a : A) {
     Args += a;
@@ -97,9 +586,6 @@ static int _Process(vector<string> &A, string &StdIn, string &StdOut,
   if (childerr == nullptr)
     childerr = stderr;
 
-  bool done = false;
-
-#ifdef WIN32
   // From
   // https://docs.microsoft.com/en-us/windows/desktop/procthread/creating-a-child-process-with-redirected-input-and-output
   BOOL status;
@@ -214,185 +700,249 @@ static int _Process(vector<string> &A, string &StdIn, string &StdOut,
       CloseHandle(pipes[idx]);
   }
 
-#else
-  int Status = -1;
-  int stdin_pipe[2], stdout_pipe[2], stderr_pipe[2];
-  pipe(stdin_pipe);
-  pipe(stdout_pipe);
-  pipe(stderr_pipe);
 
-  pid_t pid;
-  pid = fork();
-  if (pid == -1) {
-    exit(1);
-  } else if (pid == 0) {
-    /* child */
-    int exec_status;
-
-    dup2(stdin_pipe[0], STDIN_FILENO);
-    dup2(stdout_pipe[1], STDOUT_FILENO);
-    dup2(stderr_pipe[1], STDERR_FILENO);
-
-    close(stdin_pipe[0]);
-    close(stdin_pipe[1]);
-    close(stdout_pipe[0]);
-    close(stdout_pipe[1]);
-    close(stderr_pipe[0]);
-    close(stderr_pipe[1]);
-
-    //
-    // DEBUGGING
-    // Print out the command line
-    // for (auto a : A)
-    //  std::cout << a << " ";
-    // std::cout << std::endl;
-
-    exec_status = execvp(Argv[0], const_cast<char **>(Argv.data()));
-    if (exec_status < 0) {
-      fprintf(stderr, "Problem with exec of %s\n", Argv[0]);
-      perror("");
-    }
-    _exit(1); /* no flush                             */
-  } else {
-    fd_set read_fds, write_fds;
-    struct timeval tv;
-
-    tv.tv_sec = 0;
-    tv.tv_usec = 10;
+  if (childin != nullptr)
+    fclose(childin);
 
-    int select_status;
-    int wait_status;
+  if (childout != stdout)
+    fclose(childout);
 
-    size_t size = 4095;
-    char buffer[4096];
-    ssize_t count;
-    char rbuffer[4096];
-    ssize_t rcount, rtotal;
-    rcount = rtotal = 0;
+  if (childerr != stderr)
+    fclose(childerr);
 
-    unsigned no_work_done = 0;
+#else
+  Child C;
+  if (ChildStart(C, A, StdIn, StdOut, StdErr)) {
+    vector<Child *> Children(1, &C);
+    ChildrenWait(Children, false);
+    ret = WEXITSTATUS(C.status);
+  }
 
-    do {
+#endif
+  return ret;
+}
 
-      if (childin != nullptr) {
-        if (!feof(childin)) {
-          if (rcount == rtotal) {
-            rcount = fread(rbuffer, 1, size, childin);
-            rtotal = 0;
-          }
-        }
-      }
+// Where a builtin writes one of its streams, like ChildSink
+static FILE *BuiltinSink(string &F, FILE *Std) {
+  FILE *f;
+  if (F.size()) {
+    f = fopen(F.c_str(), "w");
+    if (f == nullptr)
+      perror(F.c_str());
+  } else if (Echoed()) {
+    f = Std;
+  } else {
+#ifdef WIN32
+    f = fopen("NUL", "w");
+#else
+    f = fopen("/dev/null", "w");
+#endif
+  }
+#ifndef WIN32
+  if (f != nullptr && f != Std)
+    fcntl(fileno(f), F_SETFD, FD_CLOEXEC);
+#endif
+  return f;
+}
 
-      FD_ZERO(&read_fds);
-      FD_SET(stdout_pipe[0], &read_fds);
-      FD_SET(stderr_pipe[0], &read_fds);
-      FD_ZERO(&write_fds);
-      if (rcount != rtotal)
-        FD_SET(stdin_pipe[1], &write_fds);
-      errno = 0;
-      select_status = select(FD_SETSIZE, &read_fds, &write_fds, NULL, &tv);
-      if (select_status > 0) {
-        no_work_done = 0;
-        if (rcount != rtotal) {
-          if (FD_ISSET(stdin_pipe[1], &write_fds)) {
-            count = write(stdin_pipe[1], &rbuffer[rtotal], rcount - rtotal);
-            if (count > 1) {
-              rtotal += count;
-            } else if (count < 0) {
-              // TODO : HANDLE
-              perror("Write error");
-              fflush(stderr);
-              done = true;
-            }
-          }
-        }
-        if (FD_ISSET(stderr_pipe[0], &read_fds)) {
-          count = read(stderr_pipe[0], buffer, size);
-          buffer[count] = 0;
-          fprintf(childerr, "%s", buffer);
-          fflush(childerr);
-          if (childerr != stdout) {
-            fprintf(stdout, "%s", buffer);
-            fflush(stdout);
-          }
-        }
-        if (FD_ISSET(stdout_pipe[0], &read_fds)) {
-          count = read(stdout_pipe[0], buffer, size);
-          buffer[count] = 0;
-          fprintf(childout, "%s", buffer);
-          fflush(childout);
-          if (childout != stdout) {
-            fprintf(stdout, "%s", buffer);
-            fflush(stdout);
-          }
-        }
-      } else {
-        no_work_done++;
-        usleep(10 * no_work_done);
-        // cap at 2 sec
-        if (no_work_done > 200)
-          no_work_done = 0;
-      }
+static void EchoFile(string &F, FILE *Std) {
+  FILE *in = fopen(F.c_str(), "r");
+  if (in != nullptr) {
+    char buffer[1 << 16];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), in)) > 0)
+      fwrite(buffer, 1, count, Std);
+    fclose(in);
+    fflush(Std);
+  }
+}
 
-      // Do not wait if we are already done
-      if (!done) {
-        wait_status = waitpid(pid, &Status, WNOHANG);
-        if (wait_status > 0) {
-          done = true;
-          continue;
-        }
-      }
+// Close the sink, a captured stream is echoed once the builtin is done
+static void BuiltinSinkClose(FILE *f, string &F, FILE *Std) {
+  if (f == nullptr || f == Std)
+    return;
+  fclose(f);
+  if (F.size() && Echoed())
+    EchoFile(F, Std);
+}
 
-      if (childin != nullptr) {
-        if ((rcount == rtotal) && (feof(childin))) {
-          fclose(childin);
-          childin = nullptr;
-          close(stdin_pipe[1]);
-        }
-      }
+// Run a builtin with its output captured and echoed as a child's would be
+static int BuiltinProcess(vector<string> &A, string &StdIn, string &StdOut,
+                          string &StdErr) {
+  if (StdIn.size()) {
+    fprintf(stderr, "%s does not read stdin, it can not be the editor of a "
+                    "stdout or stderr S2S tool or have a stdin extension\n",
+            A[0].c_str());
+    fflush(stderr);
+    return -1;
+  }
+  int ret = -1;
+  FILE *Out = BuiltinSink(StdOut, stdout);
+  FILE *Err = BuiltinSink(StdErr, stderr);
+  if (Out != nullptr && Err != nullptr)
+    ret = BuiltinRun(A, Out, Err);
+  BuiltinSinkClose(Out, StdOut, stdout);
+  BuiltinSinkClose(Err, StdErr, stderr);
+  return ret;
+}
 
-      if (select_status == 0)
-        if (done)
-          break;
-        else
-          continue;
+static int ProcessOrBuiltin(vector<string> &A, string &StdIn, string &StdOut,
+                            string &StdErr) {
+  if (IsBuiltin(A))
+    return BuiltinProcess(A, StdIn, StdOut, StdErr);
+  return _Process(A, StdIn, StdOut, StdErr);
+}
 
-      if ((select_status < 1 && errno != EINTR))
-        break;
+int Process(vector<string> &A, string &StdIn, string &StdOut, string &StdErr) {
+  TempFileName(".stdout", StdOut);
+  TempFileName(".stderr", StdErr);
+  return ProcessOrBuiltin(A, StdIn, StdOut, StdErr);
+}
 
-    } while (1);
+int Process(vector<string> &A) {
+  string dummy;
+  return ProcessOrBuiltin(A, dummy, dummy, dummy);
+}
 
-    close(stdin_pipe[0]);
-    close(stdin_pipe[1]);
-    close(stdout_pipe[0]);
-    close(stdout_pipe[1]);
-    close(stderr_pipe[0]);
-    close(stderr_pipe[1]);
-  }
+int ProcessCapture(vector<string> &A, string &StdOut, string &StdErr) {
+  string dummy;
+  Quiet = true;
+  int ret = Process(A, dummy, StdOut, StdErr);
+  Quiet = false;
+  return ret;
+}
 
-  ret = WEXITSTATUS(Status);
+void ProcessEcho(string &StdOut, string &StdErr) {
+  if (!Echo)
+    return;
+  EchoFile(StdOut, stdout);
+  EchoFile(StdErr, stderr);
+}
 
+int ProcessPipeline(vector<string> &A, string &AStdout, string &AStderr,
+                    vector<string> &B, string &BStdout, string &BStderr,
+                    bool PipeStderr, bool Tee, int &RB) {
+  int ret = -1;
+  string dummy;
+  RB = -1;
+  TempFileName(".stdout", AStdout);
+  TempFileName(".stderr", AStderr);
+  string &Piped = PipeStderr ? AStderr : AStdout;
+#ifdef WIN32
+  bool Concurrent = false;
+#else
+  // A builtin is not a process its output can be piped from or into
+  bool Concurrent = !IsBuiltin(A) && !IsBuiltin(B);
 #endif
+  if (!Concurrent) {
+    // Run through the piped file
+    ret = ProcessOrBuiltin(A, dummy, AStdout, AStderr);
+    RB = Process(B, Piped, BStdout, BStderr);
+    return ret;
+  }
+#ifndef WIN32
+  string &Other = PipeStderr ? AStdout : AStderr;
+  int OtherStd = PipeStderr ? STDOUT_FILENO : STDERR_FILENO;
+  if (!Tee)
+    Piped.clear();
+  TempFileName(".stdout", BStdout);
+  TempFileName(".stderr", BStderr);
+  if (Tee)
+    IgnoreSigpipe();
+
+  Child CA, CB;
+  Stream &S = PipeStderr ? CA.err : CA.out;
+  Stream &O = PipeStderr ? CA.out : CA.err;
+  int fdsA[3] = {-1, -1, -1}, fdsB[3] = {-1, -1, -1};
+  int pipeA[2] = {-1, -1}, pipeB[2] = {-1, -1};
+  StreamInit(S);
+  CloexecPipe(pipeA);
+  if (Tee) {
+    // A -> relay -> B, the relay tees into B and moves into the file
+    S.file = OpenCapture(Piped);
+    if (S.file != -1 && CloexecPipe(pipeB) == 0) {
+      S.fd = pipeA[0];
+      S.echo = pipeB[1];
+      S.own = true;
+#ifdef __linux__
+      S.tee = true;
+#endif
+      SetNonBlocking(S.echo);
+      fdsB[0] = pipeB[0];
+    } else {
+      CloseFd(pipeA[0]);
+    }
+  } else {
+    fdsB[0] = pipeA[0];
+  }
+  fdsA[0] = ChildInput(dummy);
+  fdsA[PipeStderr ? 2 : 1] = pipeA[1];
+  fdsA[PipeStderr ? 1 : 2] = ChildSink(Other, OtherStd, O);
+  fdsB[1] = ChildSink(BStdout, STDOUT_FILENO, CB.out);
+  fdsB[2] = ChildSink(BStderr, STDERR_FILENO, CB.err);
+
+  vector<Child *> Children;
+  if (ChildLaunch(CA, A, fdsA))
+    Children.push_back(&CA);
+  if (ChildLaunch(CB, B, fdsB))
+    Children.push_back(&CB);
+  ChildrenWait(Children, false);
+  if (CA.pid != -1)
+    ret = WEXITSTATUS(CA.status);
+  if (CB.pid != -1)
+    RB = WEXITSTATUS(CB.status);
+#endif
+  return ret;
+}
 
-  if (childin != nullptr)
-    fclose(childin);
-
-  if (childout != stdout)
-    fclose(childout);
+void ProcessAll(vector<vector<string>> &A, vector<int> &R) {
+  ProcessAll(A, R, false);
+}
 
-  if (childerr != stderr)
-    fclose(childerr);
+void ProcessAll(vector<vector<string>> &A, vector<int> &R,
+                bool StopOnFailure) {
+  R.assign(A.size(), -1);
+#ifdef WIN32
+  for (size_t i = 0; i < A.size(); i++) {
+    R[i] = Process(A[i]);
+    if (StopOnFailure && R[i] != 0)
+      break;
+  }
+#else
+  string dummy;
+  vector<Child> C(A.size());
+  vector<Child *> Children;
+  for (size_t i = 0; i < A.size(); i++) {
+    C[i].group = StopOnFailure;
+    if (IsBuiltin(A[i]))
+      R[i] = BuiltinProcess(A[i], dummy, dummy, dummy);
+    else if (ChildStart(C[i], A[i], dummy, dummy, dummy))
+      Children.push_back(&C[i]);
+  }
+  ChildrenWait(Children, StopOnFailure);
+  for (auto c : Children)
+    if (WIFEXITED(c->status))
+      R[c - C.data()] = WEXITSTATUS(c->status);
+#endif
+}
 
-  return ret;
+void ProcessSetSpawn(ProcessSpawn S) {
+#ifndef WIN32
+  Spawn = S;
+#endif
 }
 
-int Process(vector<string> &A, string &StdIn, string &StdOut, string &StdErr) {
-  TempFileName(".stdout", StdOut);
-  TempFileName(".stderr", StdErr);
-  return _Process(A, StdIn, StdOut, StdErr);
+void ProcessSetEcho(bool E) {
+#ifndef WIN32
+  Echo = E;
+#endif
 }
 
-int Process(vector<string> &A) {
-  string dummy;
-  return _Process(A, dummy, dummy, dummy);
+double ProcessSpawnBenchmark(unsigned N) {
+  vector<string> A = {"true"};
+  auto Start = chrono::steady_clock::now();
+  for (unsigned i = 0; i < N; i++)
+    Process(A);
+  chrono::duration<double, micro> T = chrono::steady_clock::now() - Start;
+  return N ? T.count() / N : 0.0;
 }
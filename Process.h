@@ -14,8 +14,36 @@
 #include <string>
 #include <vector>
 
+enum ProcessSpawn { SPAWN_FORK, SPAWN_POSIX_SPAWN };
+
 int Process(std::vector<std::string> &A);
 int Process(std::vector<std::string> &A, std::string &StdinFile,
             std::string &StdoutFile, std::string &StderrFile);
+// Like Process with the output captured and not echoed, ProcessEcho
+// shows it once the caller knows it is wanted
+int ProcessCapture(std::vector<std::string> &A, std::string &StdoutFile,
+                   std::string &StderrFile);
+void ProcessEcho(std::string &StdoutFile, std::string &StderrFile);
+// Run A and B at the same time with A's stdout, or stderr, piped into
+// B's stdin.  The other streams are captured like Process.  With Tee the
+// piped stream is also saved to its capture file.  Returns A's exit
+// code, RB gets B's.
+int ProcessPipeline(std::vector<std::string> &A, std::string &AStdout,
+                    std::string &AStderr, std::vector<std::string> &B,
+                    std::string &BStdout, std::string &BStderr,
+                    bool PipeStderr, bool Tee, int &RB);
+// Run all of the command lines at once, R gets their exit codes
+void ProcessAll(std::vector<std::vector<std::string>> &A, std::vector<int> &R);
+// With StopOnFailure the first to fail has the rest terminated, each
+// with the processes it started.  A command line killed by a signal gets
+// -1.
+void ProcessAll(std::vector<std::vector<std::string>> &A, std::vector<int> &R,
+                bool StopOnFailure);
+// How children are started, posix_spawn by default
+void ProcessSetSpawn(ProcessSpawn S);
+// Whether child output is echoed to stdout as well as captured
+void ProcessSetEcho(bool E);
+// Average microseconds to start and reap a trivial child N times
+double ProcessSpawnBenchmark(unsigned N);
 
 #endif
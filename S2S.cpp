@@ -8,7 +8,16 @@
 // Copyright Tom Rix 2019, all rights reserved.
 //
 //===----------------------------------------------------------------------===//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -18,15 +27,26 @@
 #else
 #include <malloc.h> // for _alloca used by boost
 #endif
+#include <thread>
 #include <vector>
 
-#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 
+#include "Cache.h"
+#include "Batch.h"
+#include "Builtin.h"
+#include "CommandStore.h"
 #include "Configuration.h"
+#include "DBStream.h"
+#include "History.h"
+#include "Pch.h"
+#include "Plugin.h"
+#include "PreFilter.h"
 #include "Process.h"
 #include "Scripting.h"
+#include "Server.h"
 #include "TempFile.h"
+#include "WriteBack.h"
 
 #include "clang/Tooling/CompilationDatabase.h"
 #include "llvm/Support/CommandLine.h"
@@ -39,352 +59,1262 @@ using namespace boost::filesystem;
 static cl::opt<bool> Help("h", cl::desc("Alias for -help"), cl::Hidden);
 
 static cl::opt<string> Script("script");
+static cl::opt<string> PluginFile(
+    "plugin", cl::desc("Shared object with compiled hooks, the script's "
+                       "hooks are used for any it does not have"));
 static cl::opt<string> Filter("db-filter");
+static cl::list<string> OnlyPath(
+    "only-path",
+    cl::desc("Only run files matching this glob.  * does not match a /, "
+             "** matches any directories.  Without a / it matches the "
+             "file's name, starting with / its absolute path, else its "
+             "path relative to the -db directory or the entry's directory"),
+    cl::ZeroOrMore);
+static cl::list<string> ExcludePath(
+    "exclude-path",
+    cl::desc("Do not run files matching this glob, matched as -only-path"),
+    cl::ZeroOrMore);
+static cl::opt<string>
+    FileRegex("file-regex", cl::desc("Only run files matching this regex"));
+static cl::opt<string> DirectoryRegex(
+    "directory-regex",
+    cl::desc("Only run entries whose directory matches this regex"));
+static cl::list<string> Compiler(
+    "compiler",
+    cl::desc("Only run entries whose compiler's name matches one of these "
+             "globs"),
+    cl::CommaSeparated);
+static cl::list<string>
+    Extension("extension",
+              cl::desc("Only run files with one of these extensions"),
+              cl::CommaSeparated);
 static cl::opt<string> DB("db");
 static cl::opt<bool> Verbose("verbose");
 static cl::opt<bool> SaveTemps("save-temps");
 static cl::opt<bool> NoCopy("no-copy");
+static cl::opt<unsigned>
+    Jobs("j", cl::desc("Number of translation units to process in parallel"),
+         cl::init(1), cl::Prefix);
+static cl::opt<string> HistoryFile(
+    "history",
+    cl::desc("Run history used to schedule the most expensive files first, "
+             "kept in the user's cache directory by default with -j"));
+static cl::opt<bool> NoHistory("no-history");
+static cl::opt<ProcessSpawn>
+    Spawn("spawn", cl::desc("How child processes are started"),
+          cl::values(clEnumValN(SPAWN_FORK, "fork", "fork and exec"),
+                     clEnumValN(SPAWN_POSIX_SPAWN, "posix_spawn",
+                                "posix_spawn (default)")),
+          cl::init(SPAWN_POSIX_SPAWN));
+static cl::opt<bool>
+    NoEcho("no-echo",
+           cl::desc("Do not echo the output of the tools to the console"));
+static cl::opt<bool> PipeEditor(
+    "pipe-editor",
+    cl::desc("Pipe stdout or stderr of the S2S tool straight into the "
+             "editor's stdin, running both at once"));
+static cl::opt<bool> UsePch(
+    "pch", cl::desc("Precompile the leading #includes for -fsyntax-only test "
+                    "stages, once per compiler and flags"));
+static cl::opt<string> CacheDirectory(
+    "cache", cl::desc("Directory of results kept across runs, a file whose "
+                      "contents, includes, flags and script are unchanged "
+                      "replays its result.  Not used with -no-copy"));
+static cl::opt<unsigned> SpawnBenchmark(
+    "spawn-benchmark",
+    cl::desc("Time N spawns of 'true' with each spawn method and exit"),
+    cl::init(0));
 
-void scrub_cl(vector<string> &CL, string &D, string &FD, string &F, string &OF) {
-  if (CL.begin() != CL.end())
-    CL.erase(CL.begin());
+static cl::opt<unsigned> HookBenchmark(
+    "hook-benchmark",
+    cl::desc("Time N passes of the script's hooks over the database and "
+             "exit"),
+    cl::init(0));
 
-  auto i = find(CL.begin(), CL.end(), F);
-  if (i != CL.end()) {
-    CL.erase(i);
-  }
-  i = find(CL.begin(), CL.end(), "-c");
-  if (i != CL.end()) {
-    CL.erase(i);
-  }
-  i = find(CL.begin(), CL.end(), "-o");
-  if (i != CL.end()) {
-    auto j = next(i, 1);
-    if (j != CL.end()) {
-      OF = *j;
-      CL.erase(j);
-    }
-    i = find(CL.begin(), CL.end(), "-o");
-    if (i != CL.end()) {
-      CL.erase(i);
+static cl::opt<string> ServerSocket(
+    "server", cl::desc("Keep the database and scripts loaded and run the "
+                       "requests sent to this unix socket with -connect"));
+static cl::opt<string>
+    Connect("connect",
+            cl::desc("Have the s2s -server on this unix socket run the files"));
+static cl::opt<bool> StreamDB(
+    "stream-db",
+    cl::desc("Run the database entries as they are read instead of loading "
+             "the whole database first, the entries run in database order"));
+static cl::opt<bool> Coalesce(
+    "coalesce",
+    cl::desc("Process a file once for all of its database entries and test "
+             "the edit with each distinct configuration, not with -stream-db"));
+static cl::opt<string> Scratch(
+    "scratch",
+    cl::desc("Where the scratch directory of the run is made, defaults to "
+             "the -db directory when it is on btrfs or XFS, so sources "
+             "are copied with reflinks, else /dev/shm when it is "
+             "writable and the temp directory otherwise"));
+static cl::opt<bool> TestUnchanged(
+    "test-unchanged",
+    cl::desc("Run the test stages even when the tools left the file as it "
+             "was"));
+static cl::opt<unsigned> TestBatch(
+    "test-batch",
+    cl::desc("Check up to this many files with the same flags in one "
+             "-fsyntax-only compiler run"),
+    cl::init(1));
+static cl::list<string>
+    InputFiles(cl::Positional,
+               cl::desc("[<file> ...] only run these files from the database"));
+
+static string HistoryScript;
+static CommandStore Commands;
+static time_t FilterTime, ScriptTime, DBTime;
+// Bumped each time the scripts are loaded, -server's workers reload theirs
+static atomic<unsigned> ScriptLoads(0);
+
+enum {
+  OUTCOME_SKIPPED,
+  OUTCOME_FAILURE,
+  OUTCOME_SUCCESS,
+  OUTCOME_UNCHANGED
+};
+
+// Drop the compiler, the file, -c and -o <output> from a database command
+// line, the output goes to OF, and make the include paths absolute.  One
+// pass over CL, the arguments that stay are moved.
+void scrub_cl(vector<string> &CL, string &D, string &FD, string &F, string &OF) {
+  vector<string> R;
+  R.reserve(CL.size());
+  bool File = false, C = false, O = false;
+  for (size_t i = 1; i < CL.size(); i++) {
+    string &cl = CL[i];
+    if (!File && cl == F) {
+      File = true;
+    } else if (!C && cl == "-c") {
+      C = true;
+    } else if (!O && cl == "-o") {
+      O = true;
+      if (i + 1 < CL.size())
+        OF = std::move(CL[++i]);
+    } else if (cl == "-I" && i + 1 < CL.size()) {
+      // Because the source is moving convert from relative to absolute paths
+      R.push_back(std::move(cl));
+      path f = CL[++i];
+      if (f.is_relative())
+        CL[i] = (D / f).string();
+      R.push_back(std::move(CL[i]));
+    } else if (cl.size() > 2 && cl.compare(0, 2, "-I") == 0) {
+      path f = cl.substr(2);
+      if (f.is_relative())
+        cl = "-I" + (D / f).string();
+      R.push_back(std::move(cl));
+    } else {
+      R.push_back(std::move(cl));
     }
   }
   // Because the source is moving, add an include path
   // back to the original source
-  string sd = "-I";
-  string s = sd + FD;
-  CL.push_back(s);
-  //
-  // Because the source is moving convert from relative to absolute paths
-  for (auto cl : CL) {
-    if (boost::algorithm::starts_with(cl, sd)) {
-      s = cl.substr(2, string::npos);
-      path f = s;
-      if (f.is_relative()) {
-        path p = D / f;
-        s = p.string();
-        s = "-I" + s;
-        replace(CL.begin(), CL.end(), cl, s);
-      }
+  R.push_back("-I" + FD);
+  CL.swap(R);
+}
+
+static path AbsoluteFile(StringRef Filename, StringRef Directory) {
+  path f = Filename.str();
+  path d = Directory.str();
+  path p;
+
+  if (f.is_absolute())
+    p = f;
+  else
+    p = boost::filesystem::absolute(f, d);
+  return p;
+}
+
+static path AbsoluteFile(CompileCommand &CC) {
+  return AbsoluteFile(CC.Filename, CC.Directory);
+}
+
+static string CanonicalFile(path p) {
+  boost::system::error_code EC;
+  path c = boost::filesystem::canonical(p, EC);
+  if (EC)
+    c = boost::filesystem::absolute(p);
+  return c.string();
+}
+
+static double Now() {
+  auto t = chrono::steady_clock::now().time_since_epoch();
+  return chrono::duration<double>(t).count();
+}
+
+static int TimedProcess(double &T, vector<string> &A) {
+  double Start = Now();
+  int Result = Process(A);
+  T += Now() - Start;
+  return Result;
+}
+
+static int TimedProcess(double &T, vector<string> &A, string &StdinFile,
+                        string &StdoutFile, string &StderrFile) {
+  double Start = Now();
+  int Result = Process(A, StdinFile, StdoutFile, StderrFile);
+  T += Now() - Start;
+  return Result;
+}
+
+// Run the S2S tool and the editor together with the tool's output
+// piped into the editor's stdin.  The piped output is only written to
+// a temp file for -save-temps.
+static bool PipeS2SToEditor(vector<string> &ICL, string &FileCopy,
+                            string &Exe, bool PipeStderr, double &T) {
+  bool editorOk = false;
+  string dummy;
+  vector<string> S2SCL, EditorCL;
+  if (GetS2SCommandLine(S2SCL, ICL, FileCopy, dummy, Exe) &&
+      GetEditorCommandLine(EditorCL, ICL, dummy, FileCopy, Exe)) {
+    if (Verbose) {
+      cout << "S2S Command line" << std::endl;
+      for (auto s : S2SCL)
+        cout << s << " ";
+      cout << std::endl;
+      cout << "Editor Command line" << std::endl;
+      for (auto s : EditorCL)
+        cout << s << " ";
+      cout << std::endl;
+    }
+    string s2sStdout, s2sStderr, editorStdout, editorStderr;
+    int EditorResult;
+    double Start = Now();
+    int Result = ProcessPipeline(S2SCL, s2sStdout, s2sStderr, EditorCL,
+                                 editorStdout, editorStderr, PipeStderr,
+                                 SaveTemps, EditorResult);
+    T += Now() - Start;
+    if (Verbose) {
+      cout << "Returns : " << Result << std::endl;
+      cout << "Returns : " << EditorResult << std::endl;
+    }
+
+    if (SaveTemps) {
+      fprintf(stdout, "S2S input  temp file %s\n", FileCopy.c_str());
+      fprintf(stdout, "S2S stdout temp file %s\n", s2sStdout.c_str());
+      fprintf(stdout, "S2S stderr temp file %s\n", s2sStderr.c_str());
+      fprintf(stdout, "Editor stdout temp file %s\n", editorStdout.c_str());
+      fprintf(stdout, "Editor stderr temp file %s\n", editorStderr.c_str());
+    } else {
+      TempFileRemove(s2sStdout);
+      TempFileRemove(s2sStderr);
+      TempFileRemove(editorStdout);
+      TempFileRemove(editorStderr);
     }
+
+    // The editor has already run, so both have to be ok
+    if (IsS2SOk(Result) && IsEditorOk(EditorResult))
+      editorOk = true;
   }
+  return editorOk;
 }
 
-int main(int argc, char **argv) {
-  int Ret = 1;
-  bool FatalError = false;
-  cl::ParseCommandLineOptions(argc, argv);
-  lua_init();
-  if (Filter != "")
-    if (lua_file(Filter.c_str())) {
-      FatalError = true;
-      fprintf(stderr, "Fatal error in filter file %s\n", Filter.c_str());
-      fflush(stderr);
+// One way the database builds a file, after scrub_cl
+struct Variant {
+  string Exe;
+  vector<string> ICL;
+  string OriginalOuput;
+};
+
+// The test stages of one test configuration of one variant.  A stage
+// reads the output of the stage before it.
+struct TestRun {
+  Variant *V;
+  string TC;
+  vector<string> TS;
+  size_t Stage;
+  string IF;
+};
+
+static void PrintCommandLine(const char *What, vector<string> &CL) {
+  cout << What << std::endl;
+  for (auto s : CL)
+    cout << s << " ";
+  cout << std::endl;
+}
+
+// Where the current stage of R writes, empty when it cannot run
+static string TestOutput(TestRun &R) {
+  string ext;
+  GetTestExtension(ext, R.TS[R.Stage]);
+  string tf = R.V->OriginalOuput;
+  if (!NoCopy)
+    TempFileName(ext, tf);
+  return tf;
+}
+
+// Run the test stages of every configuration of every variant on the
+// edit.  The configurations are independent, so the next stage of each
+// runs at the same time, in waves.  The first failure fails the file and
+// stops the rest.
+static bool RunTests(string &File, string &FileCopy, vector<Variant> &Variants,
+                     double &TestTime) {
+  string Ext = boost::filesystem::extension(File);
+  vector<TestRun> Runs;
+  for (auto &V : Variants) {
+    vector<string> TC;
+    if (GetTestConfigurations(TC, V.Exe, Ext))
+      for (auto tc : TC) {
+        TestRun R = {&V, tc, {}, 0, FileCopy};
+        if (GetTestStages(R.TS, tc) && R.TS.size())
+          Runs.push_back(R);
+      }
+  }
+
+  bool testOk = true;
+  while (testOk) {
+    // The output of each configuration's next stage
+    vector<TestRun *> Next;
+    vector<string> NextOutputs;
+    for (auto &R : Runs)
+      if (R.Stage < R.TS.size()) {
+        Next.push_back(&R);
+        NextOutputs.push_back(TestOutput(R));
+      }
+    // and their command lines in one call, when the script can
+    vector<vector<string>> NextOCLs;
+    vector<bool> NextOk;
+    bool Batched = false;
+    if (Next.size() > 1) {
+      vector<TestArgs> A;
+      for (size_t r = 0; r < Next.size(); r++) {
+        TestRun &R = *Next[r];
+        A.push_back({&R.V->ICL, &R.TC, &R.TS[R.Stage], &R.IF, &NextOutputs[r],
+                     &R.V->Exe});
+      }
+      Batched = GetTestCommandLines(A, NextOCLs, NextOk);
     }
-  if (Script != "")
-    if (lua_file(Script.c_str())) {
-      FatalError = true;
-      fprintf(stderr, "Fatal error in script file %s\n", Script.c_str());
-      fflush(stderr);
+
+    // The next stage with a command line of each configuration
+    vector<TestRun *> Wave;
+    vector<string> Stages, Outputs;
+    vector<vector<string>> OCLs, PCLs;
+    vector<bool> Pchs;
+    for (size_t r = 0; r < Next.size(); r++) {
+      TestRun &R = *Next[r];
+      for (bool First = true; R.Stage < R.TS.size(); R.Stage++) {
+        string &ts = R.TS[R.Stage];
+        string tf;
+        vector<string> OCL;
+        bool Found;
+        if (First && Batched) {
+          tf = NextOutputs[r];
+          OCL = std::move(NextOCLs[r]);
+          Found = tf.size() && NextOk[r];
+        } else {
+          tf = First ? NextOutputs[r] : TestOutput(R);
+          Found = tf.size() && GetTestCommandLine(OCL, R.V->ICL, R.TC, ts,
+                                                  R.IF, tf, R.V->Exe);
+        }
+        First = false;
+        if (Found) {
+          vector<string> PCL;
+          bool Pch = false;
+          if (UsePch) {
+            double Start = Now();
+            Pch = PchCommandLine(OCL, R.IF, PCL);
+            TestTime += Now() - Start;
+          }
+          if (Verbose) {
+            PrintCommandLine("Test Command line", OCL);
+            if (Pch)
+              PrintCommandLine("Test PCH Command line", PCL);
+          }
+          Wave.push_back(&R);
+          Stages.push_back(ts);
+          Outputs.push_back(tf);
+          OCLs.push_back(OCL);
+          PCLs.push_back(PCL);
+          Pchs.push_back(Pch);
+          break;
+        }
+      }
     }
+    if (Wave.empty())
+      break;
 
-  std::vector<std::string> failures, successes;
-  std::unique_ptr<CompilationDatabase> Compilations;
+    // The stages that can be batched join a batch, the rest and those
+    // whose batch failed run together.  A failing pch is not a failing
+    // edit, it may not stop the others.
+    vector<int> Results(Wave.size(), -1);
+    vector<vector<string>> CLs;
+    vector<size_t> Rest;
+    bool AnyPch = false, Failed = false;
+    for (size_t w = 0; w < Wave.size(); w++) {
+      vector<string> &CL = Pchs[w] ? PCLs[w] : OCLs[w];
+      AnyPch = AnyPch || Pchs[w];
+      if (BatchProcess(CL, Wave[w]->IF, Results[w], TestTime)) {
+        Failed = Failed || !IsTestOk(Results[w], Stages[w]);
+      } else {
+        Rest.push_back(w);
+        CLs.push_back(CL);
+      }
+    }
+    // A batch that failed has already failed the file
+    bool Stopped = Failed && !AnyPch;
+    if (!Stopped && Rest.size() == 1) {
+      Results[Rest[0]] = TimedProcess(TestTime, CLs[0]);
+    } else if (!Stopped && Rest.size()) {
+      vector<int> R(Rest.size(), -1);
+      double Start = Now();
+      ProcessAll(CLs, R, !AnyPch);
+      TestTime += Now() - Start;
+      for (size_t r = 0; r < Rest.size(); r++)
+        Results[Rest[r]] = R[r];
+    }
 
-  if (DB != "") {
-    string Err;
-    Compilations = CompilationDatabase::loadFromDirectory(DB, Err);
-    if (Compilations == nullptr) {
-      FatalError = true;
-      fprintf(
-          stderr,
-          "Fatal error loading compile_command.json from from %s directory\n",
-          DB.c_str());
-      fprintf(stderr, "Load error : %s\n", Err.c_str());
-      fflush(stderr);
+    for (size_t w = 0; w < Wave.size(); w++) {
+      TestRun &R = *Wave[w];
+      if (Verbose)
+        cout << "Returns : " << Results[w] << std::endl;
+      // Check a failure without the pch before blaming the edit
+      if (Pchs[w] && !IsTestOk(Results[w], Stages[w])) {
+        Results[w] = TimedProcess(TestTime, OCLs[w]);
+        if (Verbose)
+          cout << "Returns : " << Results[w] << std::endl;
+        if (IsTestOk(Results[w], Stages[w]))
+          PchFailed(OCLs[w], R.IF);
+      }
+      if (!IsTestOk(Results[w], Stages[w]))
+        testOk = false;
+      if (R.IF != FileCopy && !SaveTemps && !NoCopy)
+        TempFileRemove(R.IF);
+      R.IF = Outputs[w];
+      R.Stage++;
     }
   }
 
-  if (FatalError == true)
-    goto bail;
+  // The outputs of the last stages, and of any stopped early
+  for (auto &R : Runs)
+    if (R.IF != FileCopy && !SaveTemps && !NoCopy)
+      TempFileRemove(R.IF);
 
-  for (auto CC : Compilations->getAllCompileCommands()) {
-    string Exe = CC.CommandLine[0];
+  if (!testOk) {
+    fprintf(stderr, "\nFAILED %s\n", File.c_str());
+    fflush(stderr);
+  }
+  return testOk;
+}
 
-    if (Filter != "")
-      if (!FilterDBEntry(CC.CommandLine, CC.Filename, CC.Directory, Exe))
-        continue;
+// Entries for the same file, in different jobs, take turns.  Each copies
+// the file as the one before it left it, instead of both starting from
+// the original and the last to finish overwriting the other's edit.
+static mutex FileLocksMutex;
+static condition_variable FileLocksFree;
+static set<string> FileLocks;
+
+struct FileLock {
+  string F;
+  FileLock(const string &File) : F(File) {
+    unique_lock<mutex> lock(FileLocksMutex);
+    FileLocksFree.wait(lock, [this] { return !FileLocks.count(F); });
+    FileLocks.insert(F);
+  }
+  ~FileLock() {
+    {
+      lock_guard<mutex> lock(FileLocksMutex);
+      FileLocks.erase(F);
+    }
+    FileLocksFree.notify_all();
+  }
+};
 
-    path f = CC.Filename;
-    path d = CC.Directory;
-    path p;
-    std::string OriginalOuput = "";
+// Process a file once for all the entries of Group, the S2S tool and the
+// editor run with the first entry and the edit is tested with each.  The
+// entries are the caller's copies, they are scrubbed in place.
+static int ProcessCompileCommand(vector<CompileCommand *> &Group,
+                                 string &File) {
+  CompileCommand &CC = *Group[0];
+  int Outcome = OUTCOME_FAILURE;
+  string Exe = CC.CommandLine[0];
 
-    if (f.is_absolute())
-      p = f;
-    else
-      p = boost::filesystem::absolute(f, d);
-    file_status stat(boost::filesystem::status(p));
-    string File = p.string();
+  path p = AbsoluteFile(CC);
+  std::string OriginalOuput = "";
+  double S2STime = 0, EditorTime = 0, TestTime = 0, DiffTime = 0;
 
-    if (stat.type() == boost::filesystem::file_not_found) {
-      fprintf(stderr, "\nCould not find file : %s\n", File.c_str());
-      fflush(stderr);
-      continue;
-    }
+  file_status stat(boost::filesystem::status(p));
+  File = p.string();
+
+  if (stat.type() == boost::filesystem::file_not_found) {
+    fprintf(stderr, "\nCould not find file : %s\n", File.c_str());
+    fflush(stderr);
+    return OUTCOME_SKIPPED;
+  }
+
+  FileLock Lock(CanonicalFile(p));
+
+  fprintf(stdout, "\nCurrent file : %s\n", File.c_str());
+  fflush(stdout);
+
+  string Ext = boost::filesystem::extension(File);
+  string FileDirectory = p.parent_path().string();
 
-    fprintf(stdout, "\nCurrent file : %s\n", File.c_str());
+  scrub_cl(CC.CommandLine, CC.Directory, FileDirectory, CC.Filename, OriginalOuput);
+
+  vector<string> EditorCL, S2SCL, ICL = std::move(CC.CommandLine);
+
+  vector<Variant> Variants;
+  Variants.push_back({Exe, ICL, OriginalOuput});
+  for (size_t g = 1; g < Group.size(); g++) {
+    CompileCommand &C = *Group[g];
+    Variant V;
+    V.Exe = C.CommandLine[0];
+    scrub_cl(C.CommandLine, C.Directory, FileDirectory, C.Filename,
+             V.OriginalOuput);
+    V.ICL = std::move(C.CommandLine);
+    bool Seen = false;
+    for (auto &v : Variants)
+      if (v.Exe == V.Exe && v.ICL == V.ICL)
+        Seen = true;
+    if (!Seen)
+      Variants.push_back(std::move(V));
+  }
+  if (Variants.size() > 1) {
+    fprintf(stdout, "Configurations : %zu\n", Variants.size());
     fflush(stdout);
+  }
+  // The hooks get one table for each command line of the job
+  lua_lists_changed();
 
-    string Ext = boost::filesystem::extension(File);
-    string FileDirectory = p.parent_path().string();
+  // All the configurations are part of the key, an empty argument
+  // separates them
+  vector<string> KeyCL = ICL;
+  for (size_t v = 1; v < Variants.size(); v++) {
+    KeyCL.push_back("");
+    KeyCL.push_back(Variants[v].Exe);
+    KeyCL.insert(KeyCL.end(), Variants[v].ICL.begin(), Variants[v].ICL.end());
+  }
 
-    scrub_cl(CC.CommandLine, CC.Directory, FileDirectory, CC.Filename, OriginalOuput);
+  string Key;
+  vector<string> Deps;
+  bool Cacheable = false;
+  string Staged;
+  if (CacheDirectory != "" && !NoCopy && CacheKey(Key, File, Exe, KeyCL)) {
+    int CachedOutcome;
+    if (CacheLookup(Key, File, CachedOutcome)) {
+      fprintf(stdout, "Cached result\n");
+      fflush(stdout);
+      return CachedOutcome;
+    }
+    // The includes as they are before the edit, in any configuration
+    set<string> AllDeps;
+    Cacheable = true;
+    for (auto &V : Variants) {
+      vector<string> D;
+      if (!CacheDependencies(D, File, V.Exe, V.ICL))
+        Cacheable = false;
+      AllDeps.insert(D.begin(), D.end());
+    }
+    Deps.assign(AllDeps.begin(), AllDeps.end());
+  }
 
-    vector<string> EditorCL, S2SCL, ICL;
-    for (auto c : CC.CommandLine)
-      ICL.push_back(c);
+  // The job's temp files, and whatever the tools leave, go in a
+  // directory that is removed with the job
+  TempFileJobBegin();
+  string ScratchDirectory;
+  TempFileScratchDirectory(ScratchDirectory);
+  lua_set_string("ScratchDirectory", ScratchDirectory);
 
-    int Result;
-    bool editorOk = false;
-    string FileCopy = File;
+  int Result;
+  bool editorOk = false;
+  string FileCopy = File;
 	if (!NoCopy)
 		TempFileCopy(FileCopy, File, Ext);
-    if (FileCopy.size()) {
-      string dummy;
-      string editorExt, s2sExt;
-      if (GetS2SExtension(s2sExt)) {
-        if (s2sExt == "stderr" || s2sExt == "stdout") {
-          string s2sStdout, s2sStderr;
-          if (GetS2SCommandLine(S2SCL, ICL, FileCopy, dummy, Exe)) {
+  if (FileCopy.size()) {
+    string dummy;
+    string editorExt, s2sExt;
+    if (GetS2SExtension(s2sExt)) {
+      if ((s2sExt == "stderr" || s2sExt == "stdout") && PipeEditor &&
+          GetEditorExtension(editorExt) && editorExt == "stdin") {
+        editorOk = PipeS2SToEditor(ICL, FileCopy, Exe, s2sExt == "stderr",
+                                   S2STime);
+      } else if (s2sExt == "stderr" || s2sExt == "stdout") {
+        string s2sStdout, s2sStderr;
+        if (GetS2SCommandLine(S2SCL, ICL, FileCopy, dummy, Exe)) {
+          if (Verbose) {
+            cout << "S2S Command line" << std::endl;
+            for (auto s : S2SCL)
+              cout << s << " ";
+            cout << std::endl;
+          }
+          Result = TimedProcess(S2STime, S2SCL, dummy, s2sStdout, s2sStderr);
+          if (Verbose)
+            cout << "Returns : " << Result << std::endl;
+
+          if (SaveTemps) {
+            fprintf(stdout, "S2S input  temp file %s\n", FileCopy.c_str());
+            fprintf(stdout, "S2S stdout temp file %s\n", s2sStdout.c_str());
+            fprintf(stdout, "S2S stderr temp file %s\n", s2sStderr.c_str());
+          }
+
+          if (IsS2SOk(Result)) {
+            if (GetEditorExtension(editorExt)) {
+              if (editorExt == "stdin") {
+                string editorStdin = s2sStdout;
+                if (s2sExt == "stderr")
+                  editorStdin = s2sStderr;
+                string editorStdout, editorStderr;
+                if (GetEditorCommandLine(EditorCL, ICL, dummy, FileCopy,
+                                         Exe)) {
+                  if (Verbose) {
+                    cout << "Editor Command line" << std::endl;
+                    for (auto s : EditorCL)
+                      cout << s << " ";
+                    cout << std::endl;
+                  }
+                  Result = TimedProcess(EditorTime, EditorCL, editorStdin,
+                                        editorStdout, editorStderr);
+                  if (Verbose)
+                    cout << "Returns : " << Result << std::endl;
+
+                  if (SaveTemps) {
+                    fprintf(stdout, "Editor input temp file %s\n",
+                            FileCopy.c_str());
+                    fprintf(stdout, "Editor stdin temp file %s\n",
+                            editorStdin.c_str());
+                    fprintf(stdout, "Editor stdout temp file %s\n",
+                            editorStdout.c_str());
+                    fprintf(stdout, "Editor stderr temp file %s\n",
+                            editorStderr.c_str());
+                  } else {
+                    TempFileRemove(editorStdout);
+                    TempFileRemove(editorStderr);
+                  }
+
+                  if (IsEditorOk(Result)) {
+                    editorOk = true;
+                    // yeah
+                  }
+                }
+              } else {
+              }
+            }
+            // yeah!
+          }
+          if (!SaveTemps) {
+            TempFileRemove(s2sStdout);
+            TempFileRemove(s2sStderr);
+          }
+        }
+      } else {
+        string s2sOut;
+        TempFileName(s2sExt, s2sOut);
+        if (s2sOut.size()) {
+          if (GetS2SCommandLine(S2SCL, ICL, FileCopy, s2sOut, Exe)) {
             if (Verbose) {
               cout << "S2S Command line" << std::endl;
               for (auto s : S2SCL)
                 cout << s << " ";
               cout << std::endl;
             }
-            Result = Process(S2SCL, dummy, s2sStdout, s2sStderr);
+            Result = TimedProcess(S2STime, S2SCL);
             if (Verbose)
               cout << "Returns : " << Result << std::endl;
-
-            if (SaveTemps) {
-              fprintf(stdout, "S2S input  temp file %s\n", FileCopy.c_str());
-              fprintf(stdout, "S2S stdout temp file %s\n", s2sStdout.c_str());
-              fprintf(stdout, "S2S stderr temp file %s\n", s2sStderr.c_str());
-            }
-
             if (IsS2SOk(Result)) {
+              string editorExt;
               if (GetEditorExtension(editorExt)) {
-                if (editorExt == "stdin") {
-                  string editorStdin = s2sStdout;
-                  if (s2sExt == "stderr")
-                    editorStdin = s2sStderr;
-                  string editorStdout, editorStderr;
+                if (editorExt == "none") {
+                  // The S2S tool made its own edits
+                  editorOk = true;
+                } else if (editorExt == "stdin") {
+                  string editorStdin = s2sOut;
                   if (GetEditorCommandLine(EditorCL, ICL, dummy, FileCopy,
                                            Exe)) {
-                    if (Verbose) {
-                      cout << "Editor Command line" << std::endl;
-                      for (auto s : EditorCL)
-                        cout << s << " ";
-                      cout << std::endl;
-                    }
-                    Result = Process(EditorCL, editorStdin, editorStdout,
-                                     editorStderr);
+                    Result = TimedProcess(EditorTime, EditorCL, editorStdin,
+                                          dummy, dummy);
                     if (Verbose)
                       cout << "Returns : " << Result << std::endl;
-
-                    if (SaveTemps) {
-                      fprintf(stdout, "Editor input temp file %s\n",
-                              FileCopy.c_str());
-                      fprintf(stdout, "Editor stdin temp file %s\n",
-                              editorStdin.c_str());
-                      fprintf(stdout, "Editor stdout temp file %s\n",
-                              editorStdout.c_str());
-                      fprintf(stdout, "Editor stderr temp file %s\n",
-                              editorStderr.c_str());
-                    } else {
-                      TempFileRemove(editorStdout);
-                      TempFileRemove(editorStderr);
-                    }
-
                     if (IsEditorOk(Result)) {
                       editorOk = true;
-                      // yeah
                     }
                   }
                 } else {
-                }
-              }
-              // yeah!
-            }
-            if (!SaveTemps) {
-              TempFileRemove(s2sStdout);
-              TempFileRemove(s2sStderr);
-            }
-          }
-        } else {
-          string s2sOut;
-          TempFileName(s2sExt, s2sOut);
-          if (s2sOut.size()) {
-            if (GetS2SCommandLine(S2SCL, ICL, FileCopy, s2sOut, Exe)) {
-              if (Verbose) {
-                cout << "S2S Command line" << std::endl;
-                for (auto s : S2SCL)
-                  cout << s << " ";
-                cout << std::endl;
-              }
-              Result = Process(S2SCL);
-              if (Verbose)
-                cout << "Returns : " << Result << std::endl;
-              if (IsS2SOk(Result)) {
-                string editorExt;
-                if (GetEditorExtension(editorExt)) {
-                  if (editorExt == "stdin") {
-                    string editorStdin = s2sOut;
-                    if (GetEditorCommandLine(EditorCL, ICL, dummy, FileCopy,
-                                             Exe)) {
-                      Result = Process(EditorCL, editorStdin, dummy, dummy);
-                      if (Verbose)
-                        cout << "Returns : " << Result << std::endl;
-                      if (IsEditorOk(Result)) {
-                        editorOk = true;
-                      }
-                    }
-                  } else {
-                    if (GetEditorCommandLine(EditorCL, ICL, s2sOut, FileCopy,
-                                             Exe)) {
+                  if (GetEditorCommandLine(EditorCL, ICL, s2sOut, FileCopy,
+                                           Exe)) {
 		      if (Verbose) {
 		        cout << "Editor Command line" << std::endl;
-                        for (auto s : EditorCL)
-                          cout << s << " ";
-                        cout << std::endl;
-                      }
-                      Result = Process(EditorCL);
-                      if (Verbose)
-                        cout << "Returns : " << Result << std::endl;
-                      if (IsEditorOk(Result)) {
-                        editorOk = true;
-                      }
+                      for (auto s : EditorCL)
+                        cout << s << " ";
+                      cout << std::endl;
+                    }
+                    Result = TimedProcess(EditorTime, EditorCL);
+                    if (Verbose)
+                      cout << "Returns : " << Result << std::endl;
+                    if (IsEditorOk(Result)) {
+                      editorOk = true;
                     }
                   }
                 }
               }
             }
-            if (!SaveTemps) {
-              TempFileRemove(s2sOut);
-            } else {
-              fprintf(stdout, "S2S output temp file %s\n", s2sOut.c_str());
-            }
+          }
+          if (!SaveTemps) {
+            TempFileRemove(s2sOut);
+          } else {
+            fprintf(stdout, "S2S output temp file %s\n", s2sOut.c_str());
           }
         }
       }
     }
+  }
 
-    bool testOk = false;
-    if (editorOk) {
-      vector<string> TC;
-      string Ext = boost::filesystem::extension(p);
-      testOk = true;
-      if (GetTestConfigurations(TC, Exe, Ext)) {
-        for (auto tc : TC) {
-          vector<string> TS;
-          if (GetTestStages(TS, tc)) {
-            string IF = FileCopy;
-            for (auto ts : TS) {
-              string ext;
-              GetTestExtension(ext, ts);
-              string tf = OriginalOuput;
-	      if (!NoCopy)
-	        TempFileName(ext, tf);
-              if (tf.size()) {
-                string OF = tf;
-                vector<string> OCL;
-                if (GetTestCommandLine(OCL, ICL, tc, ts, IF, OF, Exe)) {
-                  if (Verbose) {
-                    cout << "Test Command line" << std::endl;
-                    for (auto s : OCL)
-                      cout << s << " ";
-                    cout << std::endl;
-                  }
+  bool testOk = false;
+  if (editorOk && !NoCopy && !TestUnchanged && FilesIdentical(File, FileCopy)) {
+    // The tools changed nothing, there is nothing to test or write back
+    fprintf(stdout, "Unchanged\n");
+    fflush(stdout);
+    Outcome = OUTCOME_UNCHANGED;
+  } else if (editorOk) {
+    // Every distinct configuration of the file has to pass
+    testOk = RunTests(File, FileCopy, Variants, TestTime);
+  }
 
-                  Result = Process(OCL);
-                  if (Verbose)
-                    cout << "Returns : " << Result << std::endl;
-                  if (!IsTestOk(Result, ts)) {
-                    fprintf(stderr, "\nFAILED %s\n", File.c_str());
-                    fflush(stderr);
-                    testOk = false;
-                  }
-                  if (IF != FileCopy && !SaveTemps && !NoCopy) {
-                    TempFileRemove(IF);
-                  }
-                  IF = OF;
-                }
-              }
-            }
-          }
-        }
+  if (testOk) {
+    vector<string> DiffCL;
+    if (GetDiffCommandLine(DiffCL, File, FileCopy)) {
+      if (Verbose) {
+        cout << "Diff Command line" << std::endl;
+        for (auto s : DiffCL)
+          cout << s << " ";
+        cout << std::endl;
       }
-    }
-
-    if (testOk) {
-      vector<string> DiffCL;
-      if (GetDiffCommandLine(DiffCL, File, FileCopy)) {
-        if (Verbose) {
-          cout << "Diff Command line" << std::endl;
-          for (auto s : DiffCL)
-            cout << s << " ";
-          cout << std::endl;
-        }
 
-        Result = Process(DiffCL);
-        if (Verbose)
-          cout << "Returns : " << Result << std::endl;
-        if (IsDiffOk(Result)) {
-          if (IsOverWriteOk()) {
-            TempFileOverWrite(File, FileCopy);
-          } else if (!SaveTemps && !NoCopy) {
-            TempFileRemove(FileCopy);
+      Result = TimedProcess(DiffTime, DiffCL);
+      if (Verbose)
+        cout << "Returns : " << Result << std::endl;
+      if (IsDiffOk(Result)) {
+        if (IsOverWriteOk()) {
+          // Renamed over the file once the result is cached
+          if (!WriteBackStage(File, FileCopy, Staged)) {
+            fprintf(stderr, "\nCould not stage the edit of %s\n",
+                    File.c_str());
+            fflush(stderr);
           }
+          if (!NoCopy)
+            TempFileRemove(FileCopy);
         } else if (!SaveTemps && !NoCopy) {
           TempFileRemove(FileCopy);
         }
       } else if (!SaveTemps && !NoCopy) {
         TempFileRemove(FileCopy);
       }
-      successes.push_back(File);
+    } else if (!SaveTemps && !NoCopy) {
+      TempFileRemove(FileCopy);
+    }
+    Outcome = OUTCOME_SUCCESS;
+  } else {
+    if (!SaveTemps && !NoCopy)
+      TempFileRemove(FileCopy);
+  }
+
+  TempFileJobEnd(SaveTemps);
+
+  if (Cacheable && !CacheStore(Key, Deps, Outcome, Staged)) {
+    fprintf(stderr, "Could not cache the result for %s\n", File.c_str());
+    fflush(stderr);
+  }
+  if (Staged.size())
+    WriteBackCommit(Staged);
+
+  if (HistoryFile != "") {
+    if (S2STime > 0)
+      HistoryRecord(HistoryScript, File, "s2s", S2STime);
+    if (EditorTime > 0)
+      HistoryRecord(HistoryScript, File, "editor", EditorTime);
+    if (TestTime > 0)
+      HistoryRecord(HistoryScript, File, "test", TestTime);
+    if (DiffTime > 0)
+      HistoryRecord(HistoryScript, File, "diff", DiffTime);
+  }
+  return Outcome;
+}
+
+// Dispatch the most expensive files first so a large file that happens
+// to be last in the database does not set the length of the run.  Files
+// without history are estimated from their size.
+static void Schedule(vector<vector<StoredCommand *>> &Work,
+                     vector<size_t> &Order) {
+  vector<double> Cost(Work.size(), 0.0), Size(Work.size(), 0.0);
+  vector<bool> Known(Work.size(), false);
+  double KnownSeconds = 0, KnownBytes = 0;
+  for (size_t k = 0; k < Work.size(); k++) {
+    string File =
+        AbsoluteFile(Work[k][0]->Filename, Work[k][0]->Directory).string();
+    boost::system::error_code EC;
+    uintmax_t s = boost::filesystem::file_size(File, EC);
+    if (!EC)
+      Size[k] = s;
+    if (HistoryFile != "" && HistoryCost(HistoryScript, File, Cost[k])) {
+      Known[k] = true;
+      KnownSeconds += Cost[k];
+      KnownBytes += Size[k];
+    }
+  }
+  double Rate = 1.0;
+  if (KnownSeconds > 0 && KnownBytes > 0)
+    Rate = KnownSeconds / KnownBytes;
+  for (size_t k = 0; k < Work.size(); k++)
+    if (!Known[k])
+      Cost[k] = Size[k] * Rate;
+
+  Order.resize(Work.size());
+  for (size_t k = 0; k < Work.size(); k++)
+    Order[k] = k;
+  stable_sort(Order.begin(), Order.end(),
+              [&Cost](size_t a, size_t b) { return Cost[a] > Cost[b]; });
+}
+
+// Process the stored entries of Group on copies made for this job
+static int ProcessStoredCommand(vector<StoredCommand *> &Group,
+                                string &File) {
+  vector<CompileCommand> C(Group.size());
+  vector<CompileCommand *> G(Group.size());
+  for (size_t g = 0; g < Group.size(); g++) {
+    Group[g]->get(C[g]);
+    G[g] = &C[g];
+  }
+  return ProcessCompileCommand(G, File);
+}
+
+static void WorkerRun(vector<vector<StoredCommand *>> &Work,
+                      vector<size_t> &Order, atomic<size_t> &Next,
+                      vector<int> &Outcomes, vector<string> &Files) {
+  size_t i;
+  while ((i = Next++) < Order.size()) {
+    size_t k = Order[i];
+    Outcomes[k] = ProcessStoredCommand(Work[k], Files[k]);
+  }
+}
+
+static bool WorkerLoad() {
+  lua_init();
+  if (Script == "" || lua_file(Script.c_str()) == 0)
+    return true;
+  fprintf(stderr, "Fatal error in script file %s\n", Script.c_str());
+  fflush(stderr);
+  return false;
+}
+
+// Each worker owns its own lua state, so the script is loaded per worker.
+static void Worker(vector<vector<StoredCommand *>> &Work,
+                   vector<size_t> &Order, atomic<size_t> &Next,
+                   vector<int> &Outcomes, vector<string> &Files) {
+  if (WorkerLoad())
+    WorkerRun(Work, Order, Next, Outcomes, Files);
+  BatchWorkerDone();
+  lua_cleanup();
+}
+
+// -server keeps its -j workers, and the scripts loaded in their lua
+// states, between requests.  A request gives every worker the same task
+// and waits for all of them to finish it.
+static mutex PoolMutex;
+static condition_variable PoolWake, PoolIdle;
+static function<void()> PoolTask;
+static unsigned PoolThreads = 0, PoolRound = 0, PoolBusy = 0;
+
+static void PoolWorker() {
+  unsigned Round = 0, Loaded = 0;
+  bool Ready = false, ScriptOk = false;
+  for (;;) {
+    function<void()> Task;
+    {
+      unique_lock<mutex> lock(PoolMutex);
+      PoolWake.wait(lock, [&Round] { return PoolRound != Round; });
+      Round = PoolRound;
+      Task = PoolTask;
+    }
+    if (!Ready || Loaded != ScriptLoads) {
+      lua_cleanup();
+      ScriptOk = WorkerLoad();
+      Loaded = ScriptLoads;
+      Ready = true;
+    }
+    if (ScriptOk)
+      Task();
+    BatchWorkerDone();
+    {
+      lock_guard<mutex> lock(PoolMutex);
+      PoolBusy--;
+    }
+    PoolIdle.notify_all();
+  }
+}
+
+static void PoolRun(unsigned N, function<void()> Task) {
+  unique_lock<mutex> lock(PoolMutex);
+  // The workers live as long as the server
+  for (; PoolThreads < N; PoolThreads++)
+    thread(PoolWorker).detach();
+  PoolTask = Task;
+  PoolBusy = PoolThreads;
+  PoolRound++;
+  PoolWake.notify_all();
+  PoolIdle.wait(lock, [] { return PoolBusy == 0; });
+  PoolTask = nullptr;
+}
+
+// The command line filters, which cost no lua call
+static bool PreFilter(CompileCommand &CC) {
+  if (!PreFilterActive())
+    return true;
+  string File = AbsoluteFile(CC).string();
+  string Exe = CC.CommandLine[0];
+  return PreFilterKeep(File, CC.Directory, Exe);
+}
+
+static bool PreFilter(StoredCommand &SC) {
+  if (!PreFilterActive())
+    return true;
+  string File = AbsoluteFile(SC.Filename, SC.Directory).string();
+  string Directory = SC.Directory.str();
+  string Exe = SC.exe().str();
+  return PreFilterKeep(File, Directory, Exe);
+}
+
+// Run the filter on the entries, Keep gets the ones to run.  Scripts
+// with FilterDBEntries get many entries to a call.
+static void FilterEntries(vector<CompileCommand *> &E, vector<bool> &Keep) {
+  const size_t Chunk = 256;
+  Keep.assign(E.size(), true);
+  if (Filter == "")
+    return;
+  vector<string> Exes(E.size());
+  for (size_t i = 0; i < E.size(); i++)
+    Exes[i] = E[i]->CommandLine[0];
+  for (size_t b = 0; b < E.size(); b += Chunk) {
+    size_t n = std::min(Chunk, E.size() - b);
+    vector<FilterArgs> A(n);
+    lua_lists_changed();
+    for (size_t i = 0; i < n; i++) {
+      CompileCommand &CC = *E[b + i];
+      A[i] = {&CC.CommandLine, &CC.Filename, &CC.Directory, &Exes[b + i]};
+    }
+    vector<bool> K;
+    if (FilterDBEntries(A, K)) {
+      for (size_t i = 0; i < n; i++)
+        Keep[b + i] = K[i];
+    } else {
+      for (size_t i = 0; i < n; i++)
+        Keep[b + i] = FilterDBEntry(*A[i].ICL, *A[i].IF, *A[i].ID, *A[i].Exe);
+    }
+  }
+}
+
+// The stored entries are copied out for the filter a chunk at a time
+static void FilterEntries(vector<StoredCommand *> &E, vector<bool> &Keep) {
+  const size_t Chunk = 256;
+  Keep.assign(E.size(), true);
+  if (Filter == "")
+    return;
+  vector<CompileCommand> C;
+  vector<CompileCommand *> P;
+  for (size_t b = 0; b < E.size(); b += Chunk) {
+    size_t n = std::min(Chunk, E.size() - b);
+    C.resize(n);
+    P.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      E[b + i]->get(C[i]);
+      P[i] = &C[i];
+    }
+    vector<bool> K;
+    FilterEntries(P, K);
+    for (size_t i = 0; i < n; i++)
+      Keep[b + i] = K[i];
+  }
+}
+
+static void RunCompileCommands(CommandStore &Commands,
+                               vector<string> &Only, vector<string> &failures,
+                               vector<string> &successes,
+                               vector<string> &unchanged) {
+  set<string> OnlySet(Only.begin(), Only.end());
+  vector<vector<StoredCommand *>> Work;
+  map<string, size_t> Groups;
+  vector<StoredCommand *> Entries;
+  for (auto &SC : Commands)
+    if (!OnlySet.size() ||
+        OnlySet.count(CanonicalFile(AbsoluteFile(SC.Filename, SC.Directory))))
+      if (PreFilter(SC))
+        Entries.push_back(&SC);
+  vector<bool> Keep;
+  FilterEntries(Entries, Keep);
+
+  for (size_t i = 0; i < Entries.size(); i++) {
+    if (!Keep[i])
+      continue;
+    StoredCommand *SC = Entries[i];
+
+    // With -coalesce, later entries for a file join the first one
+    if (Coalesce) {
+      string F = CanonicalFile(AbsoluteFile(SC->Filename, SC->Directory));
+      auto g = Groups.find(F);
+      if (g != Groups.end()) {
+        Work[g->second].push_back(SC);
+        continue;
+      }
+      Groups[F] = Work.size();
+    }
+    Work.push_back({SC});
+  }
+
+  vector<int> Outcomes(Work.size(), OUTCOME_FAILURE);
+  vector<string> Files(Work.size());
+  for (size_t i = 0; i < Work.size(); i++)
+    Files[i] = Work[i][0]->Filename.str();
+
+  if (Jobs > 1) {
+    vector<size_t> Order;
+    Schedule(Work, Order);
+
+    atomic<size_t> Next(0);
+    if (ServerSocket != "") {
+      BatchInit(TestBatch, Jobs);
+      PoolRun(Jobs, [&]() { WorkerRun(Work, Order, Next, Outcomes, Files); });
     } else {
-      failures.push_back(File);
+      vector<thread> Workers;
+      BatchInit(TestBatch, std::min<size_t>(Jobs, Work.size()));
+      for (unsigned j = 0; j < Jobs && j < Work.size(); j++)
+        Workers.emplace_back(Worker, std::ref(Work), std::ref(Order),
+                             std::ref(Next), std::ref(Outcomes),
+                             std::ref(Files));
+      for (auto &w : Workers)
+        w.join();
+    }
+  } else {
+    // Nothing to batch with
+    BatchInit(1, 1);
+    for (size_t i = 0; i < Work.size(); i++)
+      Outcomes[i] = ProcessStoredCommand(Work[i], Files[i]);
+  }
 
-      if (!SaveTemps && !NoCopy)
-        TempFileRemove(FileCopy);
+  // Report in database order, not in the order the jobs finished
+  for (size_t i = 0; i < Work.size(); i++) {
+    if (Outcomes[i] == OUTCOME_SUCCESS)
+      successes.push_back(Files[i]);
+    else if (Outcomes[i] == OUTCOME_FAILURE)
+      failures.push_back(Files[i]);
+    else if (Outcomes[i] == OUTCOME_UNCHANGED)
+      unchanged.push_back(Files[i]);
+  }
+}
+
+// Entries read by -stream-db waiting for a worker.  The reader blocks
+// when it is full, so only a few entries per job are held at once.
+struct StreamQueue {
+  mutex M;
+  condition_variable NotEmpty, NotFull;
+  deque<pair<size_t, CompileCommand>> Q;
+  size_t Capacity;
+  bool Done = false;
+};
+
+struct StreamResult {
+  size_t Index;
+  string File;
+  int Outcome;
+};
+
+static void StreamWorker(StreamQueue &Queue, vector<StreamResult> &Results,
+                         mutex &ResultsMutex) {
+  lua_init();
+  bool ScriptOk = Script == "" || lua_file(Script.c_str()) == 0;
+  if (!ScriptOk) {
+    fprintf(stderr, "Fatal error in script file %s\n", Script.c_str());
+    fflush(stderr);
+  }
+  for (;;) {
+    pair<size_t, CompileCommand> E;
+    {
+      unique_lock<mutex> lock(Queue.M);
+      Queue.NotEmpty.wait(
+          lock, [&Queue] { return Queue.Q.size() || Queue.Done; });
+      if (Queue.Q.empty())
+        break;
+      E = std::move(Queue.Q.front());
+      Queue.Q.pop_front();
+    }
+    Queue.NotFull.notify_one();
+
+    // Keep taking entries when the script did not load, the reader would
+    // otherwise wait forever on a full queue
+    StreamResult R = {E.first, E.second.Filename, OUTCOME_FAILURE};
+    if (ScriptOk) {
+      vector<CompileCommand *> Group = {&E.second};
+      R.Outcome = ProcessCompileCommand(Group, R.File);
+    }
+    lock_guard<mutex> lock(ResultsMutex);
+    Results.push_back(R);
+  }
+  BatchWorkerDone();
+  lua_cleanup();
+}
+
+static bool StreamCompileCommands(vector<string> &Only,
+                                  vector<string> &failures,
+                                  vector<string> &successes,
+                                  vector<string> &unchanged) {
+  set<string> OnlySet(Only.begin(), Only.end());
+  StreamQueue Queue;
+  unsigned N = Jobs > 1 ? Jobs : 1;
+  Queue.Capacity = 2 * N;
+
+  vector<StreamResult> Results;
+  mutex ResultsMutex;
+  vector<thread> Workers;
+  BatchInit(TestBatch, N);
+  for (unsigned j = 0; j < N; j++)
+    Workers.emplace_back(StreamWorker, std::ref(Queue), std::ref(Results),
+                         std::ref(ResultsMutex));
+
+  // The filter runs here, in the lua state of the main thread, on a few
+  // entries at a time
+  size_t Index = 0;
+  deque<CompileCommand> Pending;
+  auto Flush = [&]() {
+    vector<CompileCommand *> E;
+    for (auto &CC : Pending)
+      E.push_back(&CC);
+    vector<bool> Keep;
+    FilterEntries(E, Keep);
+    for (size_t i = 0; i < E.size(); i++) {
+      if (!Keep[i])
+        continue;
+      unique_lock<mutex> lock(Queue.M);
+      Queue.NotFull.wait(
+          lock, [&Queue] { return Queue.Q.size() < Queue.Capacity; });
+      Queue.Q.emplace_back(Index++, std::move(*E[i]));
+      lock.unlock();
+      Queue.NotEmpty.notify_one();
+    }
+    Pending.clear();
+  };
+  string Err;
+  string JSON = (path(DB.getValue()) / "compile_commands.json").string();
+  bool ok = DBStreamLoad(
+      JSON,
+      [&](CompileCommand &CC) {
+        if (OnlySet.size() && !OnlySet.count(CanonicalFile(AbsoluteFile(CC))))
+          return true;
+        if (!PreFilter(CC))
+          return true;
+        Pending.push_back(std::move(CC));
+        if (Pending.size() >= 64)
+          Flush();
+        return true;
+      },
+      Err);
+  Flush();
+  {
+    lock_guard<mutex> lock(Queue.M);
+    Queue.Done = true;
+  }
+  Queue.NotEmpty.notify_all();
+  for (auto &w : Workers)
+    w.join();
+
+  if (!ok) {
+    fprintf(stderr, "Fatal error reading %s\n", Err.c_str());
+    fflush(stderr);
+  }
+
+  // Report in database order, not in the order the jobs finished
+  std::sort(Results.begin(), Results.end(),
+            [](const StreamResult &a, const StreamResult &b) {
+              return a.Index < b.Index;
+            });
+  for (auto &R : Results) {
+    if (R.Outcome == OUTCOME_SUCCESS)
+      successes.push_back(R.File);
+    else if (R.Outcome == OUTCOME_FAILURE)
+      failures.push_back(R.File);
+    else if (R.Outcome == OUTCOME_UNCHANGED)
+      unchanged.push_back(R.File);
+  }
+  return ok;
+}
+
+static time_t ModTime(const string &F) {
+  boost::system::error_code EC;
+  time_t t = 0;
+  if (F != "") {
+    t = boost::filesystem::last_write_time(path(F), EC);
+    if (EC)
+      t = 0;
+  }
+  return t;
+}
+
+static bool LoadScripts() {
+  bool ret = true;
+  if (Filter != "")
+    if (lua_file(Filter.c_str())) {
+      ret = false;
+      fprintf(stderr, "Fatal error in filter file %s\n", Filter.c_str());
+      fflush(stderr);
+    }
+  if (Script != "")
+    if (lua_file(Script.c_str())) {
+      ret = false;
+      fprintf(stderr, "Fatal error in script file %s\n", Script.c_str());
+      fflush(stderr);
     }
-    // Stop at 1
-    // break;
+  FilterTime = ModTime(Filter);
+  ScriptTime = ModTime(Script);
+  ScriptLoads++;
+  return ret;
+}
+
+static bool LoadDB() {
+  string Err;
+  std::unique_ptr<CompilationDatabase> Compilations =
+      CompilationDatabase::loadFromDirectory(DB, Err);
+  if (Compilations == nullptr) {
+    fprintf(stderr,
+            "Fatal error loading compile_command.json from from %s directory\n",
+            DB.c_str());
+    fprintf(stderr, "Load error : %s\n", Err.c_str());
+    fflush(stderr);
+    return false;
   }
-  Ret = 0;
+  // Only the store is kept, the database's own copy goes when this returns
+  Commands.clear();
+  for (auto &CC : Compilations->getAllCompileCommands())
+    Commands.add(CC);
+  if (Verbose) {
+    fprintf(stdout,
+            "Database : %zu entries, %zu argument lists, %zu arguments\n",
+            Commands.size(), Commands.lists(), Commands.strings());
+    fflush(stdout);
+  }
+  DBTime = ModTime((path(DB.getValue()) / "compile_commands.json").string());
+  return true;
+}
 
-  if (failures.size() + successes.size()) {
+static int Run(vector<string> &Only) {
+  int Ret = 0;
+  std::vector<std::string> failures, successes, unchanged;
+
+  if (StreamDB) {
+    if (!StreamCompileCommands(Only, failures, successes, unchanged))
+      Ret = 1;
+  } else {
+    RunCompileCommands(Commands, Only, failures, successes, unchanged);
+  }
+  unsigned Written = WriteBackCount();
+  if (UsePch)
+    PchCleanup(SaveTemps);
+  if (HistoryFile != "")
+    if (!HistorySave(HistoryFile)) {
+      fprintf(stderr, "Could not save run history to %s\n",
+              HistoryFile.c_str());
+      fflush(stderr);
+    }
+
+  if (failures.size() + successes.size() + unchanged.size()) {
     fprintf(stdout, "\nFailures\n");
     for (auto f : failures) {
       fprintf(stdout, "%s\n", f.c_str());
@@ -395,15 +1325,272 @@ int main(int argc, char **argv) {
       fprintf(stdout, "%s\n", f.c_str());
     }
 
-    double n = successes.size();
-    double d = successes.size() + failures.size();
+    fprintf(stdout, "\nUnchanged\n");
+    for (auto f : unchanged) {
+      fprintf(stdout, "%s\n", f.c_str());
+    }
+
+    // A file the tools left alone did not fail
+    double n = successes.size() + unchanged.size();
+    double d = successes.size() + failures.size() + unchanged.size();
     double p = (100.0 * n) / d;
 
     fprintf(stdout, "Success rate %f\n", p);
+
+    unsigned Reflink, Range, Copy;
+    TempFileCopyCounts(Reflink, Range, Copy);
+    fprintf(stdout, "File copies : %u reflink, %u copy_file_range, %u copy\n",
+            Reflink, Range, Copy);
+    fprintf(stdout, "Files written back : %u\n", Written);
+    unsigned Runs, Batched, Failed;
+    BatchCounts(Runs, Batched, Failed);
+    if (Runs)
+      fprintf(stdout, "Test batches : %u runs checked %u files, %u failed\n",
+              Runs, Batched, Failed);
   } else {
     fprintf(stdout, "No work done\n");
   }
   fflush(stdout);
+  return Ret;
+}
+
+// Time each hook the driver calls for a database entry, over N passes
+// of the database, to compare interpreters
+static void RunHookBenchmark(unsigned N) {
+  enum {
+    H_FILTER,
+    H_S2S,
+    H_EDITOR,
+    H_CONFIGURATIONS,
+    H_STAGES,
+    H_TEST,
+    H_TEST_OK,
+    H_COUNT
+  };
+  const char *Names[H_COUNT] = {
+      "FilterDBEntry",         "GetS2SCommandLine", "GetEditorCommandLine",
+      "GetTestConfigurations", "GetTestStages",     "GetTestCommandLine",
+      "IsTestOk"};
+  vector<double> T(H_COUNT, 0.0);
+  vector<size_t> C(H_COUNT, 0);
+  auto Timed = [&T, &C](int H, double Start) {
+    T[H] += Now() - Start;
+    C[H]++;
+  };
+
+  for (unsigned n = 0; n < N; n++) {
+    for (auto &E : Commands) {
+      CompileCommand CC;
+      E.get(CC);
+      string Exe = CC.CommandLine[0];
+      double Start;
+      lua_lists_changed();
+      if (Filter != "") {
+        Start = Now();
+        FilterDBEntry(CC.CommandLine, CC.Filename, CC.Directory, Exe);
+        Timed(H_FILTER, Start);
+      }
+
+      path p = AbsoluteFile(CC);
+      string File = p.string();
+      string FileDirectory = p.parent_path().string();
+      string Ext = boost::filesystem::extension(File);
+      string OriginalOuput, Out = File + ".out";
+      scrub_cl(CC.CommandLine, CC.Directory, FileDirectory, CC.Filename,
+               OriginalOuput);
+      lua_lists_changed();
+      vector<string> &ICL = CC.CommandLine;
+
+      vector<string> OCL, TC;
+      Start = Now();
+      GetS2SCommandLine(OCL, ICL, File, Out, Exe);
+      Timed(H_S2S, Start);
+      Start = Now();
+      GetEditorCommandLine(OCL, ICL, Out, File, Exe);
+      Timed(H_EDITOR, Start);
+      Start = Now();
+      GetTestConfigurations(TC, Exe, Ext);
+      Timed(H_CONFIGURATIONS, Start);
+      for (auto &tc : TC) {
+        vector<string> TS;
+        Start = Now();
+        GetTestStages(TS, tc);
+        Timed(H_STAGES, Start);
+        for (auto &ts : TS) {
+          int Result = 0;
+          Start = Now();
+          GetTestCommandLine(OCL, ICL, tc, ts, File, Out, Exe);
+          Timed(H_TEST, Start);
+          Start = Now();
+          IsTestOk(Result, ts);
+          Timed(H_TEST_OK, Start);
+        }
+      }
+    }
+  }
+
+  fprintf(stdout, "Hook benchmark, %s, %u passes over %zu entries\n",
+          lua_engine(), N, Commands.size());
+  for (int h = 0; h < H_COUNT; h++)
+    if (C[h])
+      fprintf(stdout, "%-22s : %8.2f us/call, %zu calls\n", Names[h],
+              1e6 * T[h] / C[h], C[h]);
+  fflush(stdout);
+}
+
+// One -connect request.  Scripts and the database edited since the last
+// request are reloaded first.
+static int Serve(vector<string> &Args) {
+  vector<string> Only;
+  for (auto &a : Args)
+    if (a.size())
+      Only.push_back(a);
+
+  if (ModTime(Filter) != FilterTime || ModTime(Script) != ScriptTime) {
+    fprintf(stdout, "Reloading %s\n", Script.c_str());
+    fflush(stdout);
+    lua_cleanup();
+    lua_init();
+    if (!LoadScripts()) {
+      // Try again on the next request
+      ScriptTime = 0;
+      return 1;
+    }
+    if (CacheDirectory != "") {
+      string Dir = CacheDirectory;
+      string S = Script, P = PluginFile;
+      CacheInit(Dir, S, P);
+    }
+  }
+  if (ModTime((path(DB.getValue()) / "compile_commands.json").string()) !=
+      DBTime) {
+    fprintf(stdout, "Reloading %s\n", DB.c_str());
+    fflush(stdout);
+    if (!LoadDB()) {
+      DBTime = 0;
+      return 1;
+    }
+  }
+  return Run(Only);
+}
+
+int main(int argc, char **argv) {
+  int Ret = 1;
+  bool FatalError = false;
+  cl::ParseCommandLineOptions(argc, argv);
+
+  vector<string> Only;
+  for (auto &f : InputFiles)
+    Only.push_back(CanonicalFile(path(f)));
+
+  if (Connect != "")
+    return ServerConnect(Connect, Only);
+
+  if (SpawnBenchmark) {
+    // Measured in this process so the cost of duplicating the
+    // llvm sized address space shows up in the fork numbers.
+    fprintf(stdout, "Spawn benchmark, %u runs of true\n",
+            SpawnBenchmark.getValue());
+    ProcessSetSpawn(SPAWN_FORK);
+    fprintf(stdout, "fork        : %.1f us/spawn\n",
+            ProcessSpawnBenchmark(SpawnBenchmark));
+    ProcessSetSpawn(SPAWN_POSIX_SPAWN);
+    fprintf(stdout, "posix_spawn : %.1f us/spawn\n",
+            ProcessSpawnBenchmark(SpawnBenchmark));
+    fflush(stdout);
+    return 0;
+  }
+  ProcessSetSpawn(Spawn);
+  ProcessSetEcho(!NoEcho);
+
+  if (PluginFile != "") {
+    string F = PluginFile, Err;
+    if (!PluginLoad(F, Err)) {
+      fprintf(stderr, "Fatal error loading plugin %s\n", Err.c_str());
+      fflush(stderr);
+      FatalError = true;
+    }
+  }
+
+  {
+    PreFilterOptions O;
+    O.IncludePaths = OnlyPath;
+    O.ExcludePaths = ExcludePath;
+    O.Root = boost::filesystem::absolute(DB.getValue()).string();
+    O.FileRegex = FileRegex;
+    O.DirectoryRegex = DirectoryRegex;
+    O.Compilers = Compiler;
+    O.Extensions = Extension;
+    string Err;
+    if (!PreFilterInit(O, Err)) {
+      fprintf(stderr, "Fatal error in a filter pattern %s\n", Err.c_str());
+      fflush(stderr);
+      FatalError = true;
+    }
+  }
+
+  lua_init();
+  if (!LoadScripts())
+    FatalError = true;
+
+  // -server keeps the whole database, -stream-db reads it during the run
+  if (StreamDB && (ServerSocket != "" || HookBenchmark))
+    StreamDB = false;
+  if (DB != "" && !StreamDB) {
+    if (!LoadDB())
+      FatalError = true;
+  }
+
+  if (FatalError == true)
+    goto bail;
+
+  if (HookBenchmark) {
+    RunHookBenchmark(HookBenchmark);
+    goto bail;
+  }
+
+  if (NoHistory)
+    HistoryFile = "";
+  else if (HistoryFile == "" && Jobs > 1) {
+    // Only -j is scheduled, -j1 has no use for a history
+    string D = boost::filesystem::absolute(DB.getValue()).string();
+    string F;
+    if (HistoryDefaultFile(D, F))
+      HistoryFile = F;
+  }
+  if (HistoryFile != "") {
+    HistoryScript = boost::filesystem::absolute(Script.getValue()).string();
+    HistoryLoad(HistoryFile);
+  }
+
+  if (CacheDirectory != "") {
+    string Dir = CacheDirectory;
+    string S = Script, P = PluginFile;
+    if (!CacheInit(Dir, S, P)) {
+      fprintf(stderr, "Could not use the cache directory %s\n", Dir.c_str());
+      fflush(stderr);
+      CacheDirectory = "";
+    }
+  }
+
+  {
+    // The database's directory stands for the sources' file system
+    string Root = Scratch;
+    string Near = boost::filesystem::absolute(DB.getValue()).string();
+    if (!TempFileScratchInit(Root, Near)) {
+      fprintf(stderr, "Could not make a scratch directory in %s\n",
+              Root.c_str());
+      fflush(stderr);
+    }
+  }
+
+  if (ServerSocket != "") {
+    string Socket = ServerSocket;
+    Ret = ServerRun(Socket, Serve);
+  } else {
+    Ret = Run(Only);
+  }
+  TempFileScratchCleanup(SaveTemps);
 
 bail:
   lua_cleanup();
@@ -8,9 +8,10 @@
 // Copyright Tom Rix 2019, all rights reserved.
 //
 //===----------------------------------------------------------------------===//
-#include "lauxlib.h"
-#include "lua.h"
-#include "lualib.h"
+#include "Scripting.h"
+#ifdef S2S_USE_LUAJIT
+#include "luajit.h"
+#endif
 #include <iostream>
 #include <string.h>
 #include <string>
@@ -18,20 +19,36 @@
 
 using namespace std;
 
-static lua_State *L = NULL;
+static thread_local lua_State *L = NULL;
 
 lua_State *lua_get() { return L; }
 
+static void lua_forget();
+
 void lua_init() {
   if (L == NULL) {
+    lua_forget();
     L = luaL_newstate();
     luaL_openlibs(L);
+#ifdef S2S_USE_LUAJIT
+    // On by default, unless the platform or the build turned it off
+    luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_ON);
+#endif
   }
 }
 void lua_cleanup() {
   if (L)
     lua_close(L);
   L = NULL;
+  lua_forget();
+}
+
+const char *lua_engine() {
+#ifdef S2S_USE_LUAJIT
+  return LUAJIT_VERSION;
+#else
+  return LUA_RELEASE;
+#endif
 }
 
 int lua_file(const char *file) {
@@ -43,10 +60,19 @@ int lua_file(const char *file) {
     } else {
       r = 0;
     }
+    // The script may have replaced any of the hooks
+    lua_forget();
   }
   return r;
 }
 
+void lua_set_string(const char *name, string &S) {
+  if (L) {
+    lua_pushstring(L, S.c_str());
+    lua_setglobal(L, name);
+  }
+}
+
 static bool getInt(int &O, int idx) {
   bool ret = false;
   if (lua_isnumber(L, idx)) {
@@ -56,376 +82,208 @@ static bool getInt(int &O, int idx) {
   return ret;
 }
 
+// Read the strings in place, reusing the space S already has
 static bool getStrings(vector<string> &S, int idx) {
   bool ret = false;
-  S.clear();
+  size_t n = 0;
   if (lua_istable(L, idx)) {
-    signed i = 0;
-    while (++i) {
-      lua_pushinteger(L, i);
-      lua_gettable(L, idx - 1);
-      if (!lua_isstring(L, -1))
-        i = -1;
-      else
-        S.push_back(lua_tostring(L, -1));
+    if (idx < 0)
+      idx = lua_gettop(L) + idx + 1;
+    size_t len = lua_objlen(L, idx);
+    if (S.size() < len)
+      S.resize(len);
+    for (size_t i = 1; i <= len; i++) {
+      lua_rawgeti(L, idx, i);
+      size_t l;
+      const char *p = lua_isstring(L, -1) ? lua_tolstring(L, -1, &l) : NULL;
+      if (p)
+        S[n++].assign(p, l);
       lua_pop(L, 1);
+      if (!p)
+        break;
     }
   }
+  S.resize(n);
   if (S.size())
     ret = true;
   return ret;
 }
 
-static bool putStrings(vector<string> &S) {
-  bool ret = false;
-  if (S.size()) {
-    lua_newtable(L);
-    signed i = 0;
-    for (auto s : S) {
-      ++i;
-      lua_pushinteger(L, i);
-      lua_pushstring(L, s.c_str());
-      lua_settable(L, -3);
-    }
-    ret = true;
-  }
-  return ret;
-}
-
 static bool getString(string &S, int idx) {
   bool ret = false;
+  size_t l;
   if (lua_isstring(L, idx)) {
-    S = lua_tostring(L, idx);
+    const char *p = lua_tolstring(L, idx, &l);
+    S.assign(p, l);
     ret = true;
   }
   return ret;
 }
 
-bool lua_get_int(const char *func, int &O) {
-  bool ret = false;
-  lua_getglobal(L, func);
-  if (lua_pcall(L, 0, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getInt(O, -1);
-  }
-  return ret;
-}
+static const char *HookNames[HOOK_COUNT] = {
+    "FilterDBEntry",        "GetDiffCommandLine",    "GetEditorCommandLine",
+    "GetEditorExtension",   "GetS2SCommandLine",     "GetS2SExtension",
+    "GetTestCommandLine",   "GetTestConfigurations", "GetTestExtension",
+    "GetTestStages",        "IsDiffOk",              "IsEditorOk",
+    "IsS2SOk",              "IsTestOk",              "IsOverWriteOk",
+    "FilterDBEntries",      "GetTestCommandLines",
+};
 
-bool lua_get_int(const char *func, int &O, int &I) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  lua_pushinteger(L, I);
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getInt(O, -1);
-  }
-  return ret;
-}
+// Registry references to the hooks, per lua state.  A hook is looked up
+// on its first call after a script loads.
+static const int HOOK_UNRESOLVED = LUA_NOREF - 1;
+static thread_local int HookRefs[HOOK_COUNT];
+static thread_local bool HookChanges[HOOK_COUNT];
+static thread_local int BatchTop;
 
-bool lua_get_int(const char *func, int &O, int &I, string &S1) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  lua_pushinteger(L, I);
-  i++;
-  lua_pushstring(L, S1.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getInt(O, -1);
-  }
-  return ret;
-}
+// The tables of the lists pushed since the driver last changed them,
+// found by the list's address.  Lent are the ones the hook being called
+// was given, with their length.
+struct ListTable {
+  const vector<string> *List;
+  int Ref;
+  size_t Size;
+};
+static const size_t LIST_TABLES = 8;
+static thread_local vector<ListTable> Lists, Lent;
+static thread_local LuaHook Hook;
 
-bool lua_get_int(const char *func, int &O, vector<string> &IL, string &S1,
-                 string &S2, string &S3) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  putStrings(IL);
-  i++;
-  lua_pushstring(L, S1.c_str());
-  i++;
-  lua_pushstring(L, S2.c_str());
-  i++;
-  lua_pushstring(L, S3.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getInt(O, -1);
-  }
-  return ret;
+static void lua_forget_lists() {
+  for (auto &T : Lists)
+    if (L)
+      luaL_unref(L, LUA_REGISTRYINDEX, T.Ref);
+  Lists.clear();
+  Lent.clear();
 }
 
-bool lua_get_list(const char *func, vector<string> &OL) {
-  bool ret = false;
-  lua_getglobal(L, func);
-  if (lua_pcall(L, 0, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
+static void lua_forget() {
+  for (int h = 0; h < HOOK_COUNT; h++) {
+    if (L && HookRefs[h] >= 0)
+      luaL_unref(L, LUA_REGISTRYINDEX, HookRefs[h]);
+    HookRefs[h] = HOOK_UNRESOLVED;
   }
-  return ret;
+  lua_forget_lists();
 }
 
-bool lua_get_list(const char *func, vector<string> &OL, string &S) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  lua_pushstring(L, S.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
-  }
-  return ret;
-}
+void lua_lists_changed() { lua_forget_lists(); }
 
-bool lua_get_list(const char *func, vector<string> &OL, string &S1,
-                  string &S2) {
+// Whether the script names H in its ChangesCommandLine list
+static bool lua_hook_changes(LuaHook H) {
   bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  lua_pushstring(L, S1.c_str());
-  i++;
-  lua_pushstring(L, S2.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
+  lua_getglobal(L, "ChangesCommandLine");
+  if (lua_istable(L, -1)) {
+    for (size_t i = 1; !ret && i <= lua_objlen(L, -1); i++) {
+      lua_rawgeti(L, -1, i);
+      const char *n = lua_tostring(L, -1);
+      ret = n && !strcmp(n, HookNames[H]);
+      lua_pop(L, 1);
+    }
   }
+  lua_pop(L, 1);
   return ret;
 }
 
-bool lua_get_list(const char *func, vector<string> &OL, string &S1, string &S2,
-                  string &S3) {
-  bool ret = false;
-  lua_getglobal(L, func);
-  int i = 0;
-  lua_pushstring(L, S1.c_str());
-  i++;
-  lua_pushstring(L, S2.c_str());
-  i++;
-  lua_pushstring(L, S3.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
+void lua_push_hook(LuaHook H) {
+  if (HookRefs[H] == HOOK_UNRESOLVED) {
+    lua_getglobal(L, HookNames[H]);
+    HookRefs[H] = luaL_ref(L, LUA_REGISTRYINDEX);
+    HookChanges[H] = lua_hook_changes(H);
   }
-  return ret;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, HookRefs[H]);
+  Hook = H;
+  Lent.clear();
 }
 
-bool lua_get_list(const char *func, vector<string> &OL, string &S1, string &S2,
-                  string &S3, string &S4) {
-  bool ret = false;
-  lua_getglobal(L, func);
-  int i = 0;
-  lua_pushstring(L, S1.c_str());
-  i++;
-  lua_pushstring(L, S2.c_str());
-  i++;
-  lua_pushstring(L, S3.c_str());
-  i++;
-  lua_pushstring(L, S4.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
-  }
+bool lua_has_hook(LuaHook H) {
+  lua_push_hook(H);
+  bool ret = lua_isfunction(L, -1);
+  lua_pop(L, 1);
   return ret;
 }
 
-bool lua_get_list(const char *func, vector<string> &OL, string &S1, string &S2,
-                  string &S3, string &S4, string &S5) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  lua_pushstring(L, S1.c_str());
-  i++;
-  lua_pushstring(L, S2.c_str());
-  i++;
-  lua_pushstring(L, S3.c_str());
-  i++;
-  lua_pushstring(L, S4.c_str());
-  i++;
-  lua_pushstring(L, S5.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
-  }
-  return ret;
-}
+void lua_push(int I) { lua_pushinteger(L, I); }
 
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  putStrings(IL);
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
-  }
-  return ret;
-}
+void lua_push(string &S) { lua_pushlstring(L, S.data(), S.size()); }
 
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL,
-                  string &S1) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  putStrings(IL);
-  i++;
-  lua_pushstring(L, S1.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
+void lua_push_new(vector<string> &S) {
+  lua_createtable(L, S.size(), 0);
+  for (size_t i = 0; i < S.size(); i++) {
+    lua_pushlstring(L, S[i].data(), S[i].size());
+    lua_rawseti(L, -2, i + 1);
   }
-  return ret;
 }
 
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL,
-                  string &S1, string &S2) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  putStrings(IL);
-  i++;
-  lua_pushstring(L, S1.c_str());
-  i++;
-  lua_pushstring(L, S2.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
+// A hook gets the table already made for the list, unless it changes its
+// command line.  Those get a table of their own.
+void lua_push(vector<string> &S) {
+  if (HookChanges[Hook]) {
+    lua_push_new(S);
+    return;
   }
-  return ret;
-}
-
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL,
-                  string &S1, string &S2, string &S3) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  putStrings(IL);
-  i++;
-  lua_pushstring(L, S1.c_str());
-  i++;
-  lua_pushstring(L, S2.c_str());
-  i++;
-  lua_pushstring(L, S3.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
+  for (auto &T : Lists) {
+    if (T.List == &S) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, T.Ref);
+      Lent.push_back(T);
+      return;
+    }
   }
-  return ret;
+  if (Lists.size() == LIST_TABLES) {
+    luaL_unref(L, LUA_REGISTRYINDEX, Lists[0].Ref);
+    Lists.erase(Lists.begin());
+  }
+  lua_push_new(S);
+  lua_pushvalue(L, -1);
+  Lists.push_back({&S, luaL_ref(L, LUA_REGISTRYINDEX), S.size()});
+  Lent.push_back(Lists.back());
 }
 
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL,
-                  string &S1, string &S2, string &S3, string &S4) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  putStrings(IL);
-  i++;
-  lua_pushstring(L, S1.c_str());
-  i++;
-  lua_pushstring(L, S2.c_str());
-  i++;
-  lua_pushstring(L, S3.c_str());
-  i++;
-  lua_pushstring(L, S4.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
+// A hook that added or removed arguments of a table it was lent changes
+// its command line.  Its tables are dropped and it gets its own from
+// now on.
+static void lua_check_lent() {
+  bool Changed = false;
+  for (auto &T : Lent) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, T.Ref);
+    Changed = Changed || !lua_istable(L, -1) || lua_objlen(L, -1) != T.Size;
     lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
   }
-  return ret;
+  Lent.clear();
+  if (Changed) {
+    HookChanges[Hook] = true;
+    lua_forget_lists();
+  }
 }
 
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL,
-                  string &S1, string &S2, string &S3, string &S4, string &S5) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  putStrings(IL);
-  i++;
-  lua_pushstring(L, S1.c_str());
-  i++;
-  lua_pushstring(L, S2.c_str());
-  i++;
-  lua_pushstring(L, S3.c_str());
-  i++;
-  lua_pushstring(L, S4.c_str());
-  i++;
-  lua_pushstring(L, S5.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
+bool lua_call_hook(int Args) {
+  bool ret = true;
+  if (lua_pcall(L, Args, 1, 0)) {
     fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getStrings(OL, -1);
+    ret = false;
   }
+  if (Lent.size())
+    lua_check_lent();
   return ret;
 }
 
-bool lua_get_string(const char *func, string &OS) {
-  bool ret = false;
-  lua_getglobal(L, func);
-  if (lua_pcall(L, 0, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getString(OS, -1);
-  }
-  return ret;
+bool lua_result(int &O) { return getInt(O, -1); }
+
+bool lua_result(string &O) { return getString(O, -1); }
+
+bool lua_result(vector<string> &O) { return getStrings(O, -1); }
+
+void lua_batch_begin(LuaHook H, size_t N) {
+  BatchTop = lua_gettop(L);
+  lua_push_hook(H);
+  lua_createtable(L, N, 0);
 }
 
-bool lua_get_string(const char *func, string &OS, string &S1) {
-  bool ret = false;
-  int i = 0;
-  lua_getglobal(L, func);
-  lua_pushstring(L, S1.c_str());
-  i++;
-  if (lua_pcall(L, i, 1, 0)) {
-    fprintf(stderr, "Error: %s \n", lua_tostring(L, -1));
-    lua_pop(L, 1);
-  } else {
-    ret = getString(OS, -1);
+bool lua_batch_call(size_t N) {
+  bool ret = lua_call_hook(1);
+  if (ret && (!lua_istable(L, -1) || lua_objlen(L, -1) != N)) {
+    fprintf(stderr, "Error: a batch hook did not return %zu results\n", N);
+    ret = false;
   }
   return ret;
 }
+
+void lua_batch_end() { lua_settop(L, BatchTop); }
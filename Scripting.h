@@ -24,59 +24,123 @@ lua_State *lua_get();
 void lua_init();
 void lua_cleanup();
 int lua_file(const char *);
+// The interpreter the scripts run on
+const char *lua_engine();
+void lua_set_string(const char *name, string &S);
 
-bool lua_get_int(const char *func, int &O);
-bool lua_get_int(const char *func, int &O, int &I);
-bool lua_get_int(const char *func, int &O, int &I, string &IS);
-bool lua_get_int(const char *func, int &O, vector<string> &IL, string &IS1,
-                 string &IS2, string &IS3);
-bool lua_get_list(const char *func, vector<string> &OL);
-bool lua_get_list(const char *func, vector<string> &OL, string &IS);
-bool lua_get_list(const char *func, vector<string> &OL, string &IS1,
-                  string &IS2);
-bool lua_get_list(const char *func, vector<string> &OL, string &IS1,
-                  string &IS2, string &IS3);
-bool lua_get_list(const char *func, vector<string> &OL, string &IS1,
-                  string &IS2, string &IS3, string &IS4);
-bool lua_get_list(const char *func, vector<string> &OL, string &IS1,
-                  string &IS2, string &IS3, string &IS4, string &IS5);
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL);
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL,
-                  string &IS1);
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL,
-                  string &IS1, string &IS2);
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL,
-                  string &IS1, string &IS2, string &IS3);
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL,
-                  string &IS1, string &IS2, string &IS3, string &IS4);
-bool lua_get_list(const char *func, vector<string> &OL, vector<string> &IL,
-                  string &IS1, string &IS2, string &IS3, string &IS4,
-                  string &IS5);
-bool lua_get_string(const char *func, string &OS);
-bool lua_get_string(const char *func, string &OL, string &IS);
+// The functions a script defines for the driver.  Each is looked up once
+// per script and called through its reference.
+enum LuaHook {
+  HOOK_FILTER_DB_ENTRY,
+  HOOK_GET_DIFF_COMMAND_LINE,
+  HOOK_GET_EDITOR_COMMAND_LINE,
+  HOOK_GET_EDITOR_EXTENSION,
+  HOOK_GET_S2S_COMMAND_LINE,
+  HOOK_GET_S2S_EXTENSION,
+  HOOK_GET_TEST_COMMAND_LINE,
+  HOOK_GET_TEST_CONFIGURATIONS,
+  HOOK_GET_TEST_EXTENSION,
+  HOOK_GET_TEST_STAGES,
+  HOOK_IS_DIFF_OK,
+  HOOK_IS_EDITOR_OK,
+  HOOK_IS_S2S_OK,
+  HOOK_IS_TEST_OK,
+  HOOK_IS_OVER_WRITE_OK,
+  // Optional forms taking a list of argument lists, one per call of the
+  // plain hook, and returning a list of its results
+  HOOK_FILTER_DB_ENTRIES,
+  HOOK_GET_TEST_COMMAND_LINES,
+  HOOK_COUNT
+};
+
+bool lua_has_hook(LuaHook H);
+void lua_push_hook(LuaHook H);
+void lua_push(int I);
+void lua_push(string &S);
+// A list is kept as a table and pushed again until lua_lists_changed, a
+// file's command line goes to most of the hooks
+void lua_push(vector<string> &L);
+// The driver changed, or is done with, the lists it pushed
+void lua_lists_changed();
+void lua_push_new(vector<string> &L);
+bool lua_call_hook(int Args);
+bool lua_result(int &O);
+bool lua_result(string &O);
+bool lua_result(vector<string> &O);
+
+// Call hook H with the arguments In, O gets its result
+template <typename T, typename... Ts>
+bool lua_hook(LuaHook H, T &O, Ts &... In) {
+  lua_State *L = lua_get();
+  int Top = lua_gettop(L);
+  lua_push_hook(H);
+  int Pushed[] = {0, (lua_push(In), 0)...};
+  (void)Pushed;
+  bool ret = lua_call_hook(sizeof...(In)) && lua_result(O);
+  lua_settop(L, Top);
+  return ret;
+}
+
+// A batch hook call, one lua_batch_add for each set of arguments
+void lua_batch_begin(LuaHook H, size_t N);
+bool lua_batch_call(size_t N);
+void lua_batch_end();
+
+static inline void lua_batch_push(int I) { lua_push(I); }
+static inline void lua_batch_push(string &S) { lua_push(S); }
+// A command line is the table the plain hooks are given
+static inline void lua_batch_push(vector<string> &L) { lua_push(L); }
+
+template <typename... Ts> void lua_batch_add(Ts &... In) {
+  lua_State *L = lua_get();
+  int i = 0;
+  lua_createtable(L, sizeof...(In), 0);
+  int Pushed[] = {0, (lua_batch_push(In), lua_rawseti(L, -2, ++i), 0)...};
+  (void)Pushed;
+  lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+}
+
+// O gets the result of each call, Ok whether it was one.  False when the
+// hook failed or did not return a result for each call.
+template <typename T> bool lua_batch_run(vector<T> &O, vector<bool> &Ok) {
+  lua_State *L = lua_get();
+  size_t N = lua_objlen(L, -1);
+  bool ret = lua_batch_call(N);
+  if (ret) {
+    O.resize(N);
+    Ok.resize(N);
+    for (size_t i = 0; i < N; i++) {
+      lua_rawgeti(L, -1, i + 1);
+      Ok[i] = lua_result(O[i]);
+      lua_pop(L, 1);
+    }
+  }
+  lua_batch_end();
+  return ret;
+}
 
 #define LuaFilterDBEntry(O, ICL, IF, ID, X)                                    \
-  lua_get_int("FilterDBEntry", O, ICL, IF, ID, X)
+  lua_hook(HOOK_FILTER_DB_ENTRY, O, ICL, IF, ID, X)
 
 #define LuaGetDiffCommandLine(OCL, AF, BF)                                     \
-  lua_get_list("GetDiffCommandLine", OCL, AF, BF)
+  lua_hook(HOOK_GET_DIFF_COMMAND_LINE, OCL, AF, BF)
 #define LuaGetEditorCommandLine(OCL, ICL, IF, OF, X)                           \
-  lua_get_list("GetEditorCommandLine", OCL, ICL, IF, OF, X)
-#define LuaGetEditorExtension(OS) lua_get_string("GetEditorExtension", OS)
+  lua_hook(HOOK_GET_EDITOR_COMMAND_LINE, OCL, ICL, IF, OF, X)
+#define LuaGetEditorExtension(OS) lua_hook(HOOK_GET_EDITOR_EXTENSION, OS)
 #define LuaGetS2SCommandLine(OCL, ICL, IF, OF, X)                              \
-  lua_get_list("GetS2SCommandLine", OCL, ICL, IF, OF, X)
-#define LuaGetS2SExtension(OS) lua_get_string("GetS2SExtension", OS)
+  lua_hook(HOOK_GET_S2S_COMMAND_LINE, OCL, ICL, IF, OF, X)
+#define LuaGetS2SExtension(OS) lua_hook(HOOK_GET_S2S_EXTENSION, OS)
 #define LuaGetTestCommandLine(OCL, ICL, TC, TS, IF, OF, Exe)                   \
-  lua_get_list("GetTestCommandLine", OCL, ICL, TC, TS, IF, OF, Exe)
+  lua_hook(HOOK_GET_TEST_COMMAND_LINE, OCL, ICL, TC, TS, IF, OF, Exe)
 #define LuaGetTestConfigurations(OL, X, E)                                     \
-  lua_get_list("GetTestConfigurations", OL, X, E)
-#define LuaGetTestExtension(OS, TS) lua_get_string("GetTestExtension", OS, TS)
-#define LuaGetTestStages(OL, IS) lua_get_list("GetTestStages", OL, IS)
+  lua_hook(HOOK_GET_TEST_CONFIGURATIONS, OL, X, E)
+#define LuaGetTestExtension(OS, TS) lua_hook(HOOK_GET_TEST_EXTENSION, OS, TS)
+#define LuaGetTestStages(OL, IS) lua_hook(HOOK_GET_TEST_STAGES, OL, IS)
 
-#define LuaIsDiffOk(O, I) lua_get_int("IsDiffOk", O, I)
-#define LuaIsEditorOk(O, I) lua_get_int("IsEditorOk", O, I)
-#define LuaIsS2SOk(O, I) lua_get_int("IsS2SOk", O, I)
-#define LuaIsTestOk(O, I, TS) lua_get_int("IsTestOk", O, I, TS)
-#define LuaIsOverWriteOk(O) lua_get_int("IsOverWriteOk", O)
+#define LuaIsDiffOk(O, I) lua_hook(HOOK_IS_DIFF_OK, O, I)
+#define LuaIsEditorOk(O, I) lua_hook(HOOK_IS_EDITOR_OK, O, I)
+#define LuaIsS2SOk(O, I) lua_hook(HOOK_IS_S2S_OK, O, I)
+#define LuaIsTestOk(O, I, TS) lua_hook(HOOK_IS_TEST_OK, O, I, TS)
+#define LuaIsOverWriteOk(O) lua_hook(HOOK_IS_OVER_WRITE_OK, O)
 
 #endif
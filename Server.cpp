@@ -0,0 +1,301 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// A unix socket server running requests in a long lived s2s.
+//
+// The client sends its stdout and stderr with SCM_RIGHTS, followed by
+// the request arguments, each ending with a '\0', and shuts down its
+// side of the socket.  The server runs the request with the client's
+// stdout and stderr in place of its own, so the report and the output of
+// the tools go straight to the client, and replies with the 4 byte
+// status.  Requests are run one at a time.
+//
+//===----------------------------------------------------------------------===//
+#include "Server.h"
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifndef WIN32
+static bool ServerAddress(string &Socket, struct sockaddr_un &A) {
+  memset(&A, 0, sizeof(A));
+  A.sun_family = AF_UNIX;
+  if (Socket.size() >= sizeof(A.sun_path)) {
+    fprintf(stderr, "Socket path is too long %s\n", Socket.c_str());
+    fflush(stderr);
+    return false;
+  }
+  strcpy(A.sun_path, Socket.c_str());
+  return true;
+}
+
+static bool WriteAll(int fd, const char *b, size_t n) {
+  while (n) {
+    ssize_t w = write(fd, b, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    b += w;
+    n -= w;
+  }
+  return true;
+}
+
+static bool ServerReceive(int c, int fds[2], vector<string> &Args) {
+  char buf[4096];
+  union {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } u;
+  struct iovec iov = {buf, sizeof(buf)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = u.control;
+  msg.msg_controllen = sizeof(u.control);
+
+  ssize_t n;
+  do {
+    n = recvmsg(c, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return false;
+
+  // Anything but the two fds of one SCM_RIGHTS is refused, and every fd
+  // that came with it is closed
+  vector<int> Got;
+  bool ok = !(msg.msg_flags & MSG_CTRUNC);
+  for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+       cm = CMSG_NXTHDR(&msg, cm)) {
+    if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+      ok = false;
+      continue;
+    }
+    size_t Count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < Count; i++) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+      Got.push_back(fd);
+    }
+  }
+  if (!ok || Got.size() != 2) {
+    for (int fd : Got)
+      close(fd);
+    return false;
+  }
+  fds[0] = Got[0];
+  fds[1] = Got[1];
+
+  string data(buf, n);
+  while ((n = read(c, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      close(fds[0]);
+      close(fds[1]);
+      return false;
+    }
+    data.append(buf, n);
+  }
+
+  size_t s = 0, e;
+  while ((e = data.find('\0', s)) != string::npos) {
+    Args.push_back(data.substr(s, e - s));
+    s = e + 1;
+  }
+  return true;
+}
+
+// Remove a socket left at the path, anything else there is not ours to
+// remove.  With Ino, only the socket this server bound.
+static bool ServerUnlink(string &Socket, ino_t Ino) {
+  struct stat st;
+  if (lstat(Socket.c_str(), &st)) {
+    if (errno == ENOENT)
+      return true;
+    perror(Socket.c_str());
+    return false;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    fprintf(stderr, "Not replacing %s, it is not a socket\n",
+            Socket.c_str());
+    fflush(stderr);
+    return false;
+  }
+  if (Ino && st.st_ino != Ino)
+    return false;
+  return unlink(Socket.c_str()) == 0 || errno == ENOENT;
+}
+
+int ServerRun(string &Socket, ServerHandler Handler) {
+  struct sockaddr_un A;
+  if (!ServerAddress(Socket, A))
+    return 1;
+
+  // A socket left behind by an earlier server
+  if (!ServerUnlink(Socket, 0))
+    return 1;
+  int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s < 0) {
+    perror("socket");
+    return 1;
+  }
+  struct stat st;
+  if (bind(s, (struct sockaddr *)&A, sizeof(A)) || listen(s, 16) ||
+      lstat(Socket.c_str(), &st)) {
+    perror(Socket.c_str());
+    close(s);
+    return 1;
+  }
+  // A client going away must not take the server with it.  The tools
+  // are started with the default action again, see ChildSpawn.
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stdout, "Serving on %s\n", Socket.c_str());
+  fflush(stdout);
+
+  int Std[2] = {dup(1), dup(2)};
+  for (;;) {
+    int c = accept4(s, NULL, NULL, SOCK_CLOEXEC);
+    if (c < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("accept");
+      break;
+    }
+
+    int fds[2];
+    vector<string> Args;
+    if (ServerReceive(c, fds, Args)) {
+      cout.flush();
+      fflush(stdout);
+      fflush(stderr);
+      dup2(fds[0], 1);
+      dup2(fds[1], 2);
+      close(fds[0]);
+      close(fds[1]);
+
+      int32_t Status = Handler(Args);
+
+      cout.flush();
+      fflush(stdout);
+      fflush(stderr);
+      dup2(Std[0], 1);
+      dup2(Std[1], 2);
+      WriteAll(c, (const char *)&Status, sizeof(Status));
+    }
+    close(c);
+  }
+  close(s);
+  close(Std[0]);
+  close(Std[1]);
+  ServerUnlink(Socket, st.st_ino);
+  return 1;
+}
+
+int ServerConnect(string &Socket, vector<string> &Args) {
+  struct sockaddr_un A;
+  if (!ServerAddress(Socket, A))
+    return 1;
+
+  int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s < 0) {
+    perror("socket");
+    return 1;
+  }
+  if (connect(s, (struct sockaddr *)&A, sizeof(A))) {
+    perror(Socket.c_str());
+    close(s);
+    return 1;
+  }
+
+  string data;
+  for (auto &a : Args) {
+    data += a;
+    data += '\0';
+  }
+  // The fds have to go with at least one byte of data
+  if (data.empty())
+    data += '\0';
+
+  int fds[2] = {1, 2};
+  union {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } u;
+  struct iovec iov = {(void *)data.data(), data.size()};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = u.control;
+  msg.msg_controllen = sizeof(u.control);
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(2 * sizeof(int));
+  memcpy(CMSG_DATA(cm), fds, 2 * sizeof(int));
+
+  int32_t Status = 1;
+  ssize_t n;
+  do {
+    n = sendmsg(s, &msg, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n >= 0 && WriteAll(s, data.data() + n, data.size() - n)) {
+    shutdown(s, SHUT_WR);
+    char *b = (char *)&Status;
+    size_t got = 0;
+    while (got < sizeof(Status)) {
+      n = read(s, b + got, sizeof(Status) - got);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        fprintf(stderr, "Lost the connection to %s\n", Socket.c_str());
+        fflush(stderr);
+        Status = 1;
+        break;
+      }
+      got += n;
+    }
+  } else {
+    perror(Socket.c_str());
+  }
+  close(s);
+  return Status;
+}
+#else
+int ServerRun(string &Socket, ServerHandler Handler) {
+  fprintf(stderr, "-server is not supported on windows\n");
+  fflush(stderr);
+  return 1;
+}
+
+int ServerConnect(string &Socket, vector<string> &Args) {
+  fprintf(stderr, "-connect is not supported on windows\n");
+  fflush(stderr);
+  return 1;
+}
+#endif
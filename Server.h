@@ -0,0 +1,23 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+typedef std::function<int(std::vector<std::string> &)> ServerHandler;
+
+int ServerRun(std::string &Socket, ServerHandler Handler);
+int ServerConnect(std::string &Socket, std::vector<std::string> &Args);
+
+#endif
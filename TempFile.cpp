@@ -16,10 +16,122 @@
 #include <boost/system/error_code.hpp>
 #include <iostream>
 #include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#endif
+#include <atomic>
+
+// Temp files go in a scratch directory made for the run, and in a
+// directory of their own for each file the jobs process.  Tools that
+// scan a directory only see the files of their job, and a job's files
+// are removed together with its directory.
+static boost::filesystem::path RunDirectory;
+static std::atomic<unsigned> Reflinks(0), Ranges(0), Copies(0);
+static thread_local boost::filesystem::path JobDirectory;
+
+static boost::filesystem::path TempFileDirectory() {
+  if (!JobDirectory.empty())
+    return JobDirectory;
+  if (!RunDirectory.empty())
+    return RunDirectory;
+  return boost::filesystem::temp_directory_path();
+}
+
+// Whether D is on a file system that can share extents, btrfs or XFS
+static bool Reflinkable(boost::filesystem::path &D) {
+#ifdef __linux__
+  struct statfs s;
+  if (statfs(D.c_str(), &s) == 0)
+    return s.f_type == BTRFS_SUPER_MAGIC || s.f_type == XFS_SUPER_MAGIC;
+#endif
+  return false;
+}
+
+bool TempFileScratchInit(std::string &Root, std::string &Near) {
+  boost::system::error_code EC;
+  boost::filesystem::path r = Root;
+  std::string Name = "s2s-%%%%-%%%%-%%%%-%%%%";
+  if (Root.empty()) {
+    r = boost::filesystem::temp_directory_path();
+    boost::filesystem::path n = Near;
+#ifndef WIN32
+    if (Near.size() && Reflinkable(n) &&
+        access(Near.c_str(), W_OK | X_OK) == 0) {
+      // Snapshots of the sources and the edits written back are then
+      // reflinks, hidden beside the build
+      r = n;
+      Name = "." + Name;
+    } else if (boost::filesystem::is_directory("/dev/shm", EC) &&
+               access("/dev/shm", W_OK | X_OK) == 0) {
+      // tmpfs, the copies and tool outputs never need to reach a disk
+      r = "/dev/shm";
+    }
+#endif
+  }
+  boost::filesystem::path d = r / boost::filesystem::unique_path(Name);
+  boost::filesystem::create_directories(d, EC);
+  if (EC)
+    return false;
+  RunDirectory = d;
+  return true;
+}
+
+void TempFileScratchCleanup(bool Keep) {
+  boost::system::error_code EC;
+  if (RunDirectory.empty())
+    return;
+  if (Keep)
+    std::cout << "Scratch directory " << RunDirectory.string() << std::endl;
+  else
+    boost::filesystem::remove_all(RunDirectory, EC);
+  RunDirectory.clear();
+}
+
+void TempFileJobBegin() {
+  boost::system::error_code EC;
+  if (RunDirectory.empty())
+    return;
+  boost::filesystem::path d = RunDirectory / boost::filesystem::unique_path();
+  boost::filesystem::create_directory(d, EC);
+  if (!EC)
+    JobDirectory = d;
+}
+
+void TempFileJobEnd(bool Keep) {
+  boost::system::error_code EC;
+  if (JobDirectory.empty())
+    return;
+  if (!Keep)
+    boost::filesystem::remove_all(JobDirectory, EC);
+  JobDirectory.clear();
+}
+
+void TempFileScratchDirectory(std::string &D) {
+  D = TempFileDirectory().string();
+}
+
+// For files that outlive the job that makes them
+void TempFileRunName(const char *Ext, std::string &OF) {
+  boost::filesystem::path d = RunDirectory;
+  if (d.empty())
+    d = boost::filesystem::temp_directory_path();
+  OF = (d / boost::filesystem::unique_path()).string() + Ext;
+}
 
 void TempFileName(std::string &Ext, std::string &OF) {
-  boost::filesystem::path p = boost::filesystem::temp_directory_path() /
-                              boost::filesystem::unique_path();
+  boost::filesystem::path p =
+      TempFileDirectory() / boost::filesystem::unique_path();
 
   OF = p.string();
   if (Ext.size())
@@ -34,6 +146,10 @@ void TempFileName(const char *Ext, std::string &OF) {
 void TempFileRemove(std::string &F) {
   unsigned retry_count = 0;
   unsigned retry_max = 59;
+  // Goes with the job directory
+  if (!JobDirectory.empty() &&
+      boost::filesystem::path(F).parent_path() == JobDirectory)
+    return;
 retry:
   boost::filesystem::path p = F;
   if (boost::filesystem::exists(p)) {
@@ -58,14 +174,106 @@ retry:
     std::cerr << "Failed to delete " << F << " " << retry_count << " times\n";
 }
 
+#ifndef WIN32
+static bool WriteAll(int fd, const char *b, ssize_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, b, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    b += w;
+    n -= w;
+  }
+  return true;
+}
+
+// Share the extents with a reflink, or have the kernel copy them, or
+// copy through a buffer when the file systems differ.
+static void TempCopy(std::string &IF, std::string &OF,
+                     boost::system::error_code &EC) {
+  EC.clear();
+  int in = open(IF.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    EC.assign(errno, boost::system::system_category());
+    return;
+  }
+  struct stat st;
+  int out = -1;
+  if (fstat(in, &st) == 0)
+    out = open(OF.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+               st.st_mode & 07777);
+  if (out < 0) {
+    EC.assign(errno, boost::system::system_category());
+    close(in);
+    return;
+  }
+
+  bool done = false;
+#ifdef __linux__
+  if (ioctl(out, FICLONE, in) == 0) {
+    Reflinks++;
+    done = true;
+  } else {
+    off_t left = st.st_size;
+    ssize_t n = 0;
+    while (left > 0 &&
+           (n = copy_file_range(in, NULL, out, NULL, left, 0)) > 0)
+      left -= n;
+    // Nothing copied, EXDEV or EINVAL, is left to the buffer copy.  A
+    // partial copy continues from where it stopped.
+    if (left == 0) {
+      Ranges++;
+      done = true;
+    }
+  }
+#endif
+  if (!done) {
+    static thread_local char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 || !WriteAll(out, buf, n)) {
+        EC.assign(errno, boost::system::system_category());
+        break;
+      }
+    }
+    if (!EC)
+      Copies++;
+  }
+  close(in);
+  if (close(out) && !EC)
+    EC.assign(errno, boost::system::system_category());
+}
+#else
+static void TempCopy(std::string &IF, std::string &OF,
+                     boost::system::error_code &EC) {
+  boost::filesystem::copy_file(boost::filesystem::path(IF),
+                               boost::filesystem::path(OF), EC);
+  if (!EC)
+    Copies++;
+}
+#endif
+
+bool TempFileCopyContents(std::string &OF, std::string &IF) {
+  boost::system::error_code EC;
+  TempCopy(IF, OF, EC);
+  return !EC;
+}
+
+void TempFileCopyCounts(unsigned &Reflink, unsigned &Range, unsigned &Copy) {
+  Reflink = Reflinks;
+  Range = Ranges;
+  Copy = Copies;
+}
+
 void TempFileCopy(std::string &OF, std::string &IF, std::string &Ext) {
   OF.clear();
   TempFileName(Ext, OF);
   if (OF.size()) {
     boost::system::error_code EC;
-    boost::filesystem::path IP = IF;
-    boost::filesystem::path OP = OF;
-    boost::filesystem::copy_file(IP, OP, EC);
+    TempCopy(IF, OF, EC);
 
     if (EC) {
       TempFileRemove(OF);
@@ -81,15 +289,6 @@ void TempFileRename(std::string &OF, std::string &IF) {
   boost::filesystem::rename(IP, OP);
 }
 
-void TempFileOverWrite(std::string &OF, std::string &IF) {
-  boost::system::error_code EC;
-  boost::filesystem::path IP = IF;
-  boost::filesystem::path OP = OF;
-  TempFileRemove(OF);
-  boost::filesystem::copy_file(IP, OP, EC);
-  TempFileRemove(IF);
-}
-
 void TempFilePipeName(std::string &OF) {
   std::string X = "\\\\.\\pipe\\";
   boost::filesystem::path p = boost::filesystem::unique_path();
@@ -17,8 +17,17 @@ void TempFileName(std::string &Ext, std::string &OF);
 void TempFileName(const char *Ext, std::string &OF);
 void TempFileRemove(std::string &F);
 void TempFileCopy(std::string &OF, std::string &IF, std::string &Ext);
-void TempFileOverWrite(std::string &OF, std::string &IF);
 void TempFileRename(std::string &OF, std::string &IF);
 void TempFilePipeName(std::string &OF);
+void TempFileRunName(const char *Ext, std::string &OF);
+// Without a Root, the scratch directory goes in Near when it can reflink
+// the sources, else on /dev/shm or in the temp directory
+bool TempFileScratchInit(std::string &Root, std::string &Near);
+void TempFileScratchCleanup(bool Keep);
+void TempFileScratchDirectory(std::string &D);
+void TempFileJobBegin();
+void TempFileJobEnd(bool Keep);
+bool TempFileCopyContents(std::string &OF, std::string &IF);
+void TempFileCopyCounts(unsigned &Reflink, unsigned &Range, unsigned &Copy);
 
 #endif
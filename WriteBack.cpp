@@ -0,0 +1,150 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// Writing the edits back to the sources.
+//
+// An edit is first copied to a hidden file beside the source it
+// replaces, with the source's permissions, and synced.  The job renames
+// it over the source when it is done, and waits for the directory to be
+// synced.  The jobs renaming into a directory while its sync runs share
+// the next one, so a directory is synced once for a group of files, not
+// once per file.  A source is always either the original or the edit, a
+// later entry for the same file starts from the edit, and a crash only
+// loses the jobs in flight and leaves their hidden .<name>.s2s-* files
+// behind.
+//
+//===----------------------------------------------------------------------===//
+#include "WriteBack.h"
+#include "TempFile.h"
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+using boost::filesystem::path;
+
+// staged file -> source
+static map<string, string> Pending;
+static mutex PendingMutex;
+static atomic<unsigned> Written(0);
+
+// The renames into a directory and how many of them a finished sync
+// covers
+struct DirectorySync {
+  unsigned long long Renamed = 0, Synced = 0;
+  bool Syncing = false;
+};
+static map<string, DirectorySync> Directories;
+static condition_variable DirectorySynced;
+
+static void SyncDirectory(string &D) {
+#ifndef WIN32
+  int fd = open(D.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+#endif
+}
+
+// Wait until the rename just done into D is synced.  The first job to
+// find no sync running syncs every rename done so far, the others wait
+// for it or for the one after.
+static void WaitSynced(string &D) {
+  unique_lock<mutex> lock(PendingMutex);
+  DirectorySync &S = Directories[D];
+  unsigned long long Mine = ++S.Renamed;
+  while (S.Synced < Mine) {
+    if (S.Syncing) {
+      DirectorySynced.wait(lock);
+      continue;
+    }
+    S.Syncing = true;
+    unsigned long long Upto = S.Renamed;
+    lock.unlock();
+    SyncDirectory(D);
+    lock.lock();
+    S.Synced = Upto;
+    S.Syncing = false;
+    DirectorySynced.notify_all();
+  }
+}
+
+bool WriteBackStage(string &File, string &Edit, string &Staged) {
+  path p = File;
+  path d = p.parent_path();
+  Staged = (d / ("." + p.filename().string() + ".s2s-" +
+                 boost::filesystem::unique_path().string()))
+               .string();
+  if (!TempFileCopyContents(Staged, Edit)) {
+    Staged.clear();
+    return false;
+  }
+#ifndef WIN32
+  int fd = open(Staged.c_str(), O_WRONLY | O_CLOEXEC);
+  bool ok = fd >= 0;
+  if (ok) {
+    struct stat st;
+    if (stat(File.c_str(), &st) == 0)
+      fchmod(fd, st.st_mode & 07777);
+    // Synced here, in the job, so the commit only has the renames and
+    // one sync per directory left
+    ok = fsync(fd) == 0;
+    close(fd);
+  }
+  if (!ok) {
+    unlink(Staged.c_str());
+    Staged.clear();
+    return false;
+  }
+#endif
+  lock_guard<mutex> lock(PendingMutex);
+  Pending[Staged] = File;
+  return true;
+}
+
+bool WriteBackCommit(string &Staged) {
+  string File;
+  {
+    lock_guard<mutex> lock(PendingMutex);
+    auto i = Pending.find(Staged);
+    if (i == Pending.end())
+      return false;
+    File = i->second;
+    Pending.erase(i);
+  }
+  boost::system::error_code EC;
+  boost::filesystem::rename(path(Staged), path(File), EC);
+  if (EC) {
+    fprintf(stderr, "Could not write back %s : %s\n", File.c_str(),
+            EC.message().c_str());
+    fflush(stderr);
+    boost::filesystem::remove(path(Staged), EC);
+    return false;
+  }
+  string D = path(File).parent_path().string();
+  WaitSynced(D);
+  Written++;
+  return true;
+}
+
+unsigned WriteBackCount() { return Written.exchange(0); }
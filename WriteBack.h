@@ -0,0 +1,24 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <string>
+
+// Copy Edit to a hidden file beside File, Staged gets its name
+bool WriteBackStage(std::string &File, std::string &Edit, std::string &Staged);
+// Rename a staged edit over its file and wait for its directory's sync,
+// which is shared with the other jobs committing there
+bool WriteBackCommit(std::string &Staged);
+// The number of files written back since the last call
+unsigned WriteBackCount();
+
+#endif
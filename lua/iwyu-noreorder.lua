@@ -206,7 +206,7 @@ end
 
 function GetDiffCommandLine(AFile, BFile)
   local r = {}
-  r[#r+1] = "diff"
+  r[#r+1] = "s2s:diff"
   r[#r+1] = "-up"
   r[#r+1] = AFile
   r[#r+1] = BFile
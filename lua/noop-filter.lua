@@ -19,3 +19,13 @@ function FilterDBEntry(CommandLine, InputFile, InputDirectory, Exe)
   -- end
   return r
 end
+
+-- Used instead of FilterDBEntry when it is defined, with the arguments
+-- of many FilterDBEntry calls at once.  Returns a result for each.
+function FilterDBEntries(Entries)
+  local r = {}
+  for i, e in ipairs(Entries) do
+    r[i] = FilterDBEntry(e[1], e[2], e[3], e[4])
+  end
+  return r
+end
@@ -114,6 +114,16 @@ function GetTestCommandLine(CommandLine, TestConfiguration, TestStage, InputFile
   return r
 end
 
+-- The command lines of the next stage of each test configuration in one
+-- call, each entry has the arguments of a GetTestCommandLine call
+function GetTestCommandLines(Entries)
+  local r = {}
+  for i, e in ipairs(Entries) do
+    r[i] = GetTestCommandLine(e[1], e[2], e[3], e[4], e[5])
+  end
+  return r
+end
+
 function GetTestExtension(TestStage)
   local r = ""
   if TestStage == "cpp" then
@@ -145,7 +155,12 @@ function GetS2SCommandLine(CommandLine, InputFile, OutputFile, Exe)
   local r = {}
 
   local d,f,x = SplitFilename(InputFile)
-  local cdb = d .. "compile_commands.json"
+  -- Keep the database in the job's own directory, not beside the input
+  local sd = d
+  if ScratchDirectory then
+    sd = ScratchDirectory .. "/"
+  end
+  local cdb = sd .. "compile_commands.json"
   local file = io.open(cdb, "wt")
   file:write("[\n")
   file:write("    {\n")
@@ -172,7 +187,7 @@ function GetS2SCommandLine(CommandLine, InputFile, OutputFile, Exe)
   r[#r+1] = "clang-tidy"
   s = "-export-fixes=" .. OutputFile
   r[#r+1] = s
-  s = "-p=" .. d
+  s = "-p=" .. sd
   r[#r+1] = s
 --  if Exe == "c++" then
 --    r[#r+1] = "c++"
@@ -200,6 +215,10 @@ end
 function GetEditorCommandLine(CommandLine, InputFile, OutputFile, Exe)
   local r = {}
   local d,f,x = SplitFilename(InputFile)
+  -- Only the fixes of this job are in its scratch directory
+  if ScratchDirectory then
+    d = ScratchDirectory
+  end
   r[#r+1] = "clang-apply-replacements"
   r[#r+1] = d
   return r
@@ -220,7 +239,7 @@ end
 
 function GetDiffCommandLine(AFile, BFile)
   local r = {}
-  r[#r+1] = "diff"
+  r[#r+1] = "s2s:diff"
   r[#r+1] = "-up"
   r[#r+1] = AFile
   r[#r+1] = BFile
@@ -188,6 +188,10 @@ end
 function GetEditorCommandLine(CommandLine, InputFile, OutputFile, Exe)
   local r = {}
   local d,f,x = SplitFilename(InputFile)
+  -- Only the fixes of this job are in its scratch directory
+  if ScratchDirectory then
+    d = ScratchDirectory
+  end
   r[#r+1] = "clang-apply-replacements"
   r[#r+1] = d
   return r
@@ -208,7 +212,7 @@ end
 
 function GetDiffCommandLine(AFile, BFile)
   local r = {}
-  r[#r+1] = "diff"
+  r[#r+1] = "s2s:diff"
   r[#r+1] = "-up"
   r[#r+1] = AFile
   r[#r+1] = BFile
@@ -0,0 +1,117 @@
+//===----------------------------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright Tom Rix 2019, all rights reserved.
+//
+//===----------------------------------------------------------------------===//
+//
+// The test, exit code and diff hooks of lua/tidy.lua compiled.  Run with
+//
+//   s2s -plugin=libs2s-example-plugin.so -script=lua/tidy.lua ...
+//
+// The S2S tool and editor hooks are left null, they still come from the
+// script.
+//
+//===----------------------------------------------------------------------===//
+#include "Plugin.h"
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static bool FilterDBEntry(vector<string> &ICL, string &IF, string &ID,
+                          string &Exe) {
+  return true;
+}
+
+static bool GetTestConfigurations(vector<string> &TC, string &X, string &E) {
+  TC.clear();
+  if (X == "cc")
+    TC.push_back("gcc");
+  else if (X == "c++")
+    TC.push_back("g++");
+  return TC.size();
+}
+
+static bool GetTestStages(vector<string> &TS, string &TC) {
+  TS.clear();
+  if (TC == "gcc")
+    TS.push_back("cc");
+  else if (TC == "g++")
+    TS.push_back("cxx");
+  return TS.size();
+}
+
+// clang is not tolerant of c++ options in c
+static bool IsCxxOption(string &O) {
+  return O == "-std=gnu++98" || O == "-Woverloaded-virtual" ||
+         O == "-fno-rtti";
+}
+
+static bool GetTestCommandLine(vector<string> &OCL, vector<string> &ICL,
+                               string &TC, string &TS, string &IF, string &OF,
+                               string &Exe) {
+  OCL.clear();
+  if (TC == "gcc" && TS == "cc")
+    OCL.push_back("gcc");
+  else if (TC == "g++" && TS == "cxx")
+    OCL.push_back("g++");
+  else
+    return false;
+  for (auto &a : ICL)
+    if (TS != "cc" || !IsCxxOption(a))
+      OCL.push_back(a);
+  OCL.push_back("-fsyntax-only");
+  OCL.push_back(IF);
+  OCL.push_back("-o");
+  OCL.push_back(OF);
+  return true;
+}
+
+static bool GetTestExtension(string &E, string &TS) {
+  E = ".o";
+  return true;
+}
+
+static bool IsTestOk(int &I, string &TS) { return I == 0; }
+
+static bool IsS2SOk(int &I) { return I == 0; }
+
+static bool IsEditorOk(int &I) { return I == 0; }
+
+static bool IsOverWriteOk() { return true; }
+
+static bool GetDiffCommandLine(vector<string> &OCL, string &AF, string &BF) {
+  OCL = {"s2s:diff", "-up", AF, BF};
+  return true;
+}
+
+// diff exits 1 when the files differ
+static bool IsDiffOk(int &I) { return I == 1; }
+
+static S2SPlugin Example = {
+    S2S_PLUGIN_VERSION,
+    sizeof(S2SPlugin),
+    "example",
+    FilterDBEntry,
+    GetTestConfigurations,
+    GetTestStages,
+    GetTestCommandLine,
+    GetTestExtension,
+    IsTestOk,
+    nullptr, // GetS2SCommandLine
+    nullptr, // GetS2SExtension
+    IsS2SOk,
+    nullptr, // GetEditorCommandLine
+    nullptr, // GetEditorExtension
+    IsEditorOk,
+    IsOverWriteOk,
+    GetDiffCommandLine,
+    IsDiffOk,
+};
+
+extern "C" const S2SPlugin *s2s_plugin() { return &Example; }